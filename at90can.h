@@ -108,7 +108,19 @@ void	detachInterrupt(uint8_t);
 // defined on time.c
 void		initTime(void);
 unsigned long	millis(void);
+/// Microseconds since the program started, wrapping every ~71 minutes
+unsigned long	micros(void);
 void		delay(unsigned long ms);
+/// Timer 1 ticks since the program started, wrapping every ~71 minutes
+/// at 8 MHz
+unsigned long	timeTicks(void);
+/// Timer 1 prescaler
+#define TIME_PRESCALER		8
+/// Timer 1 ticks per millisecond, the timer 1 compare match period
+#define TIME_TICKS_PER_MS	(F_CPU/TIME_PRESCALER/1000UL)
+#if TIME_TICKS_PER_MS > 0xFFFF
+# error F_CPU too high for the timer 1 prescaler
+#endif
 
 
 #endif
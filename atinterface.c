@@ -20,17 +20,34 @@
 
 */
 
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+
 #include "atinterface.h"
 #include "serials.h"
+#include "odolog.h"
+#include "sched.h"
+#include "profile.h"
+#include "ram.h"
 
 /// Golbal variables defined within derkgps.c
-extern volatile unsigned long d_pcount;
 /// Last computed odometer pulses frequency
 extern unsigned long d_freq;
-/// Current max [ppm/s] OVER_SPEED alarm
-extern unsigned long d_minOverSpeed;
-/// Current max [ppm/s] decelleration EMERGENCY_BREAK alarm
-extern unsigned long d_minEmergencyBreak;
+/// Last computed odometer pulses frequency [mHz]
+extern unsigned long d_freqMilli;
+/// Not-null if the frequency is measured by the pulses period
+extern uint8_t d_odoPeriodMode;
+/// Odometer pulses per km, 0 if not yet calibrated
+extern unsigned long d_ppk;
+/// Filtered acceleration [mm/s^2], 0 if not calibrated
+extern long d_accel;
+/// Odometer update window [pulses] and [ms]
+extern unsigned d_odoWindowPulses;
+extern unsigned d_odoWindowTime;
+void odoSavePpk(void);
+void odoSetTotal(unsigned long count);
+/// Resets by brown-out, defined within odolog.c
+extern uint16_t d_brownouts;
 /// Delay ~[s] between dispaly monitor sentences, if 0 DISABLED (default 0);
 extern unsigned d_displayTime;
 /// The GPS power state: 1=ON, 0=OFF
@@ -41,10 +58,24 @@ extern unsigned d_gpsNextCmd;
 extern derkgps_event_t d_pendingEvents[EVENT_CLASS_TOT];
 /// How long an interrupt last [ms]
 extern unsigned d_intrTimeout;
+/// Event records overwritten before being read
+extern uint16_t d_eventOverflow;
+/// Monitor format: 0 full lines, 1 delta lines
+extern uint8_t d_displayMode;
+/// Delta monitor: periods between two full lines (keyframes)
+extern unsigned d_displayKeyframe;
+/// Delta monitor: min count, freq [Hz] and position [10^-4 deg] variation
+extern unsigned d_displayDelta;
+/// Delta monitor: periods to next keyframe
+extern unsigned d_displayCount;
+/// Min time between two interrupts [ms]
+extern unsigned d_intrHoldoff;
+/// Min time the interrupt line is released before being asserted again [ms]
+extern unsigned d_intrGap;
+/// Interrupt statistics
+extern derkgps_intr_stats_t d_intrStats;
 /// Pulses between distance interrupts
 extern unsigned d_distIntrPCount;
-/// Pulses of next distance interrupt
-extern unsigned long d_distIntrNext;
 
 /// The buffer for output and result return
 // extern char d_displayBuff[OUTPUT_BUFFER_SIZE];
@@ -52,49 +83,100 @@ extern unsigned long d_distIntrNext;
 char d_outBuff[OUTPUT_BUFFER_SIZE];
 
 /// Readed and parsed value
-unsigned long  newValueUL;
 unsigned newValueU;
 
-#define cmdLook()	look(UART_AT)
-#define cmdRead()	read(UART_AT)
-#define cmdAvailable()	available(UART_AT)
+/// Port whose baud rate has to be changed once the result has been sent
+/// (UART_NUM if none)
+uint8_t cmdBaudPort = UART_NUM;
+/// The new baud rate for cmdBaudPort
+unsigned long cmdBaudRate;
+/// If not 0, cmdBaudRate must be saved into EEPROM
+unsigned cmdBaudSave;
 
-#define Serial_printValue(STR)	printStr(UART_AT, STR); printStr(UART_AT, " ")
+/// The parser state, the line being parsed is kept across calls
+uint8_t cmdState = CMD_IDLE;
+/// The result of the commands parsed so far on cmdLine
+int cmdResult;
 
+/// Returned by cmdRead() and cmdLook() at the end of the line: it must not
+/// be mistaken for a (0xFF) char
+#define CMD_EOL		-1
 
-#define ShowValue(VALUE)				\
-	snprintf(d_outBuff, OUTPUT_BUFFER_SIZE,	\
-		 "%d", VALUE);				\
-	Serial_printStr(d_outBuff);			\
-	Serial_printStr(" ")
+/// Max command lines parsed per call
+#define CMD_LINES	UART_LINES
+/// TX queue room required to run a command without blocking
+/// NOTE +QSN, the longest single line reply, takes ~90 bytes: multi-line
+///	replies are suspended once a line does not fit, see CMD_PENDING
+#define CMD_TX_ROOM	96
+/// TX queue room required to send a line of a multi-line reply
+#define CMD_LINE_ROOM	(OUTPUT_BUFFER_SIZE+2)
+#if CMD_TX_ROOM > UART0_TXBUFFER_SIZE || CMD_LINE_ROOM > CMD_TX_ROOM
+# error The AT port TX queue is too small for the command replies
+#endif
+/// TX queue room required to send a command result
+#define CMD_RESULT_ROOM	12
+
+/// The command line being parsed, still sitting into the UART buffer
+uart_line_t cmdLine;
+/// Next char to parse within cmdLine
+uint8_t cmdPos;
+
+/// Returned by a REG_CMD handler whose reply has been suspended on a full
+/// TX queue: the register is parsed again and the handler resumes its reply
+/// from cmdCursor
+#define CMD_PENDING	1
+/// The next line (or item) of a suspended multi-line reply, 0 if none
+uint8_t cmdCursor = 0;
+
+/// Get the next char of the command line, CMD_EOL once it has been consumed
+/// NOTE lineChar() evaluates its index more than once, thus cmdPos must be
+///	incremented apart
+inline int cmdRead(void) {
+	int c;
 	
+	if (cmdPos >= cmdLine.len)
+		return CMD_EOL;
+	c = lineChar(&cmdLine, cmdPos);
+	cmdPos++;
+	return c;
+}
+
+#define cmdLook()	((cmdPos<cmdLine.len) ? lineChar(&cmdLine, cmdPos) : CMD_EOL)
+#define cmdAvailable()	(cmdLine.len-cmdPos)
+
+/// Buffer for binary response frame formatting
+uint8_t frameBuff[UART_FRAME_MAXLEN];
+/// Bytes into frameBuff
+uint8_t frameLen;
+
+#define Serial_printValue(STR)	printStr(UART_AT, STR); printStr_P(UART_AT, PSTR(" "))
+
+
 #define ShowValueU(VALUE)				\
-	snprintf(d_outBuff, OUTPUT_BUFFER_SIZE,	\
-		 "%u", VALUE);				\
+	snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE,	\
+		 PSTR("%u"), VALUE);			\
 	Serial_printStr(d_outBuff);			\
-	Serial_printStr(" ")
+	Serial_printStr_P(PSTR(" "))
 
 #define ShowValueUL(VALUE)				\
-	snprintf(d_outBuff, OUTPUT_BUFFER_SIZE,	\
-		 "%lu", VALUE);				\
-	Serial_printStr(d_outBuff);			\
-	Serial_printStr(" ")
-
-#define ShowValueD(VALUE)					\
-	formatDouble(VALUE, d_outBuff, OUTPUT_BUFFER_SIZE);	\
+	snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE,	\
+		 PSTR("%lu"), VALUE);			\
 	Serial_printStr(d_outBuff);			\
-	Serial_printStr(" ")
+	Serial_printStr_P(PSTR(" "))
 
 /// Copy a command value from UART buffer to local (d_outBuff) buffer
 void cmdReadValue() {
 	short iValRead = 0;
+	int c;
+	
 	do {
-		d_outBuff[iValRead] = cmdLook();
-		if (d_outBuff[iValRead]!=-1 &&		// uart empty
-		    d_outBuff[iValRead]!=LINE_TERMINATOR &&	// line end
-		    d_outBuff[iValRead]!='+') {		// cmd following
+		c = cmdLook();
+		if (iValRead<OUTPUT_BUFFER_SIZE-1 &&	// buffer full
+		    c!=CMD_EOL &&			// line consumed
+		    c!=LINE_TERMINATOR &&		// line end
+		    c!='+') {				// cmd following
 			// Removing char from uart buffer
-			cmdRead();
+			d_outBuff[iValRead] = cmdRead();
 			iValRead++;
 		} else {
 			// Null terminating string and returning
@@ -106,394 +188,1089 @@ void cmdReadValue() {
 
 #define ReadValueU(VALUE)				\
 	cmdReadValue();					\
-	sscanf(d_outBuff, "%u", &newValueU);	\
+	sscanf_P(d_outBuff, PSTR("%u"), &newValueU);	\
 	VALUE = newValueU;
 
-#define ReadValueUL(VALUE)				\
-	cmdReadValue();					\
-	sscanf(d_outBuff, "%lu", &newValueUL);	\
-	VALUE = newValueUL;
+/// Scale a GPS double value into an integer one
+#define FRAME_DOUBLE(VALUE, SCALE)	(long)((VALUE)*(SCALE))
+#define FRAME_INVALID			0x7FFFFFFF
 
-inline int parseAlarmCmd(int type) {
-	
-	switch(cmdRead()) {
-	case 'E':
-		switch(cmdRead()) { 
-		case 'B':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Emergency Break"
-				ShowValueUL(d_minEmergencyBreak);
-				goto pac_ok;
-			case '=':
-				// WRITE "Emergency Break"
-				cmdRead();
-				ReadValueUL(d_minEmergencyBreak);
-				goto pac_ok;
-			}
-			goto pac_error;
-		}
-		goto pac_error;
-	case 'P':
-		switch(cmdRead()) { 
-		case 'C':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Pulse Count Interrupt"
-				ShowValueU(d_distIntrPCount);
-				goto pac_ok;
-			case '=': // WRITE "Pulse Count Interrupt"
-				cmdRead();
-				ReadValueU(d_distIntrPCount);
-				d_distIntrNext = d_pcount+d_distIntrPCount;
-				goto pac_ok;
-			}
-			goto pac_error;
-		}
-		goto pac_error;
+/// A coherent copy of the live registers, see +QSN and REG_QSN
+typedef struct {
+	long lat;		///< Latitude [10^-6 deg], invalid: FRAME_INVALID
+	long lon;		///< Longitude [10^-6 deg], invalid: FRAME_INVALID
+	uint16_t speed;		///< Ground speed [10 m/h]
+	uint16_t degree;	///< Track degree [1/100 deg]
+	uint16_t hdop;		///< HDOP [1/100]
+	uint8_t fix;		///< Fix value
+	uint16_t events;	///< Pending events, GPS into the MSB (not ACKed)
+	unsigned long pcount;	///< Pulse count [pulses]
+	unsigned long freq;	///< Pulse frequency [Hz]
+	unsigned long uptime;	///< Uptime [ms]
+} at_snapshot_t;
 
-	case 'S':
-		switch(cmdRead()) { 
-		case 'L':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Speed Limit"
-				ShowValueUL(d_minOverSpeed);
-				goto pac_ok;
-			case '=': // WRITE "Speed Limit"
-				cmdRead();
-				ReadValueUL(d_minOverSpeed);
-				goto pac_ok;
-			}
-			goto pac_error;
-		}
-		goto pac_error;
+/// The snapshot size into a binary frame [bytes]
+#define SNAPSHOT_SIZE	29
+
+/// Take a coherent copy of the live registers.
+/// GPS data and events are updated only by the main loop, while the
+/// odometer and the uptime are updated by ISRs: these are read at once.
+void cmdSnapshot(at_snapshot_t *snap) {
+	uint8_t sreg;
+	
+	if (gpsIsPosValid()) {
+		snap->lat = FRAME_DOUBLE(gpsLat(), 1000000);
+		snap->lon = FRAME_DOUBLE(gpsLon(), 1000000);
+	} else {
+		snap->lat = FRAME_INVALID;
+		snap->lon = FRAME_INVALID;
 	}
+	snap->speed  = FRAME_DOUBLE(gpsSpeed(), 100);
+	snap->degree = FRAME_DOUBLE(gpsDegree(), 100);
+	snap->hdop   = FRAME_DOUBLE(gpsHdop(), 100);
+	snap->fix    = gpsFix();
+	snap->events = d_pendingEvents[EVENT_CLASS_GPS];
+	snap->events <<= 8;
+	snap->events |= d_pendingEvents[EVENT_CLASS_ODO];
+	snap->freq   = d_freq;
+	
+	sreg = SREG;
+	cli();
+	snap->pcount = odoPulseCount();
+	snap->uptime = millis();
+	SREG = sreg;
+}
 
-pac_error:
-	return ERROR;
-pac_ok:
-	return OK;
+/// Read and ACK pending events, releasing the interrupt line
+/// @return GPS events into the MSB, ODO events into the LSB
+uint16_t cmdAckEvents(void) {
+	uint16_t events;
+	
+	events = d_pendingEvents[EVENT_CLASS_GPS];
+	events <<= 8;
+	events |= d_pendingEvents[EVENT_CLASS_ODO];
+	
+	// Resetting pending event
+	d_pendingEvents[EVENT_CLASS_GPS] = EVENT_NONE;
+	d_pendingEvents[EVENT_CLASS_ODO] = EVENT_NONE;
+	
+	// Releasgin interrupt pin
+	intrRelease(0);
+	
+	return events;
+}
+
+//----- Registers
+
+/// Getters for REG_FUNC registers
+long regGpsFix(void) {
+	return gpsFix();
+}
 
+long regGpsSpeed(void) {
+	return FRAME_DOUBLE(gpsSpeed(), 100);
 }
 
-inline int parseGpsCmd(int type) {
+long regGpsHdop(void) {
+	return FRAME_DOUBLE(gpsHdop(), 100);
+}
+
+long regGpsLat(void) {
+	return gpsIsPosValid() ? FRAME_DOUBLE(gpsLat(), 1000000) : FRAME_INVALID;
+}
+
+long regGpsLon(void) {
+	return gpsIsPosValid() ? FRAME_DOUBLE(gpsLon(), 1000000) : FRAME_INVALID;
+}
+
+long regGpsDegree(void) {
+	return FRAME_DOUBLE(gpsDegree(), 100);
+}
+
+long regOdoSpeed(void) {
+	if (!d_ppk)
+		return FRAME_INVALID;
+	// [mHz]*100/[pulses/km] = [cm/s]
+	return (d_freqMilli*100)/d_ppk;
+}
+
+long regOdoDistance(void) {
+	unsigned long count;
 	
-	switch(cmdRead()) {
-	case 'F':
-		switch(cmdRead()) {
-		case 'V':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Fix value"
-				ShowValueU(gpsFix());
-				goto pgc_ok;
-			}
-			goto pgc_error;
-		}
-		goto pgc_error;
-	case 'G':
-		switch(cmdRead()) {
-		case 'S':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Ground speed"
-				ShowValueD(gpsSpeed());
-				goto pgc_ok;
-			}
-			goto pgc_error;
-		}
-		goto pgc_error;
-	case 'H':
-		switch(cmdRead()) {
-		case 'P':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "HDOP"
-				ShowValueD(gpsHdop());
-				goto pgc_ok;
-			}
-			goto pgc_error;
+	if (!d_ppk)
+		return FRAME_INVALID;
+	count = odoPulseCount();
+	return (count/d_ppk)*1000 + ((count%d_ppk)*1000)/d_ppk;
+}
+
+long regOdoAccel(void) {
+	if (!d_ppk)
+		return FRAME_INVALID;
+	return d_accel;
+}
+
+/// Write hooks
+void regDistHook(void) {
+	odoSetDistance(d_distIntrPCount);
+}
+
+/// Speed and break rules are enabled by setting a threshold
+void regRuleEnable(uint8_t idx) {
+	d_rules[idx].cmp = d_rules[idx].threshold ? RULE_GT : RULE_OFF;
+	resetRule(idx);
+}
+
+void regSpeedHook(void) {
+	regRuleEnable(RULE_SPEED);
+}
+
+void regBreakHook(void) {
+	regRuleEnable(RULE_BREAK);
+}
+
+void regPpkHook(void) {
+	odoSavePpk();
+}
+
+void regDisplayHook(void) {
+	// Restarting with a keyframe
+	d_displayCount = 0;
+}
+
+int framePut(unsigned long value, uint8_t bytes);
+int frameGet(unsigned long *value, uint8_t bytes);
+
+/// Handlers for REG_CMD registers
+int regSubscribe(uint8_t type, uint8_t write);
+long regEventCount(void) {
+	return eventCount();
+}
+
+long regIdleLoad(void) {
+	return d_schedIdleLoad;
+}
+
+long regOdoLogSeq(void) {
+	return odoLogSeq();
+}
+
+int regEvents(uint8_t type, uint8_t write) {
+	unsigned long events;
+	
+	// READ  "Event register"
+	events = cmdAckEvents();
+	if (type == BINARY)
+		return framePut(events, 2);
+	
+	snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE, PSTR("%lu 0x%04lX"),
+			events, events);
+	Serial_printValue(d_outBuff);
+	return OK;
+}
+
+/// Bytes of TX queue required to send an event record
+#define EVENT_REC_LINE	72
+
+int regEventQueue(uint8_t type, uint8_t write) {
+	derkgps_event_rec_t rec;
+	uint8_t sent = 0;
+	
+	// READ  "Event queue"
+	if (type == BINARY) {
+		// One record for each read, an empty queue returns a 0 class
+		// and event
+		if ( !eventPop(&rec) )
+			memset(&rec, 0, sizeof(rec));
+		framePut(rec.eclass, 1);
+		framePut(rec.event, 1);
+		framePut(rec.time, 4);
+		framePut(rec.pcount, 4);
+		framePut(rec.freq, 4);
+		framePut(rec.speed, 2);
+		framePut(rec.lat, 4);
+		framePut(rec.lon, 4);
+	} else {
+		// As much records as the TX queue could take, one per line:
+		// class event time pcount freq speed lat lon
+		while ( (!sent || txFree(UART_AT) >= EVENT_REC_LINE) &&
+				eventPop(&rec) ) {
+			snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE,
+				PSTR("%u 0x%02X %lu %lu %lu %u "),
+				rec.eclass, rec.event, rec.time,
+				rec.pcount, rec.freq, rec.speed);
+			Serial_printStr(d_outBuff);
+			snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE, PSTR("%ld %ld"),
+				rec.lat, rec.lon);
+			Serial_printLine(d_outBuff);
+			sent++;
 		}
-		goto pgc_error;
-	case 'L':
-		switch(cmdRead()) {
-		case 'A':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Lat"
-				if (gpsIsPosValid()) {
-					ShowValueD(gpsLat());
-				} else
-					Serial_printStr("NA ");
-				goto pgc_ok;
-			}
-			goto pgc_error;
-		case 'O':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Lon"
-				if (gpsIsPosValid()) {
-					ShowValueD(gpsLon());
-				} else
-					Serial_printStr("NA ");
-				goto pgc_ok;
-			}
-			goto pgc_error;
+	}
+	
+	// Once all the records have been read the interrupt is released
+	if ( !eventCount() )
+		cmdAckEvents();
+	
+	return OK;
+}
+
+int regIntrStats(uint8_t type, uint8_t write) {
+	unsigned long value;
+	uint8_t nonZero;
+	uint8_t i;
+	
+	if (!write) {
+		// READ  "Interrupt Statistics": asserted, coalesced, expired
+		if (type == BINARY) {
+			framePut(d_intrStats.asserted, 2);
+			framePut(d_intrStats.coalesced, 2);
+			return framePut(d_intrStats.expired, 2);
 		}
-		goto pgc_error;
-	case 'P':
-		switch(cmdRead()) {
-		case 'S':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Power State"
-				ShowValueU(d_gpsPowerState);
-				goto pgc_ok;
-			case '=':
-				// WRITE "Power State"
-				cmdRead();
-				ReadValueU(d_gpsPowerState);
-				goto pgc_ok;
-			}
-			goto pgc_error;
+		ShowValueU(d_intrStats.asserted);
+		ShowValueU(d_intrStats.coalesced);
+		ShowValueU(d_intrStats.expired);
+		return OK;
+	}
+	
+	// WRITE "Interrupt Statistics", only 0 (reset) allowed
+	if (type == BINARY) {
+		// NOTE all the values are consumed before checking them
+		nonZero = 0;
+		for (i=0; i<3; i++) {
+			if ( frameGet(&value, 2) != OK )
+				return ERROR;
+			nonZero |= (value != 0);
 		}
-		goto pgc_error;
-	case 'S':
-		switch(cmdRead()) {
-		case 'C':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '=': // WRITE "GPS Command"
-				cmdRead();
-				ReadValueUL(d_gpsNextCmd);
-				goto pgc_ok;
+		if (nonZero)
+			return ERROR;
+	} else {
+		ReadValueU(newValueU);
+		if (newValueU)
+			return ERROR;
+	}
+	memset(&d_intrStats, 0, sizeof(d_intrStats));
+	return OK;
+}
+
+int regPulseCount(uint8_t type, uint8_t write) {
+	unsigned long value;
+	char *end;
+	
+	if (!write) {
+		// READ  "Pulse Count": the total one
+		if (type == BINARY)
+			return framePut(odoPulseCount(), 4);
+		ShowValueUL(odoPulseCount());
+		return OK;
+	}
+	
+	// WRITE "Pulse Count"
+	if (type == BINARY) {
+		if ( frameGet(&value, 4) != OK )
+			return ERROR;
+	} else {
+		cmdReadValue();
+		value = strtoul(d_outBuff, &end, 0);
+		if ( end == d_outBuff || *end )
+			return ERROR;
+	}
+	odoSetTotal(value);
+	return OK;
+}
+
+int regTasks(uint8_t type, uint8_t write) {
+	sched_task_t *task;
+	uint8_t i;
+	
+	if (!write) {
+		// READ  "Tasks statistics", a task per line:
+		// id,runs,misses,avg runtime [us],max runtime [us]
+		for (i=cmdCursor; i<d_tasksCount; i++) {
+			if ( txFree(UART_AT) < CMD_LINE_ROOM ) {
+				cmdCursor = i;
+				return CMD_PENDING;
 			}
-			goto pgc_error;
+			task = &d_tasks[i];
+			snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE,
+				PSTR("%u,%u,%u,%lu,%u"), i,
+				task->runs, task->misses,
+				task->runs ? task->runtime/task->runs : 0,
+				task->maxRuntime);
+			Serial_printLine(d_outBuff);
 		}
-		goto pgc_error;
+		cmdCursor = 0;
+		return OK;
+	}
+	
+	// WRITE "Tasks statistics", only 0 (reset) allowed
+	ReadValueU(newValueU);
+	if (newValueU)
+		return ERROR;
+	schedResetStats();
+	return OK;
+}
 
-	case 'T':
-		switch(cmdRead()) {
-		case 'D':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Track Degree"
-				ShowValueD(gpsDegree());
-				goto pgc_ok;
+int regProfile(uint8_t type, uint8_t write) {
+#ifdef PROFILE
+	profile_stats_t stats;
+	uint8_t i;
+	
+	if (!write) {
+		// READ  "Profiler", a stage per line:
+		// stage,count,min,avg,max [cycles]
+		for (i=cmdCursor; i<PROF_STAGES; i++) {
+			if ( txFree(UART_AT) < CMD_LINE_ROOM ) {
+				cmdCursor = i;
+				return CMD_PENDING;
 			}
-			goto pgc_error;
+			profileGet(i, &stats);
+			snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE,
+				PSTR("%u,%u,%lu,%lu,%lu"), i, stats.count,
+				(unsigned long)stats.min*TIME_PRESCALER,
+				stats.count ?
+				(stats.total/stats.count)*TIME_PRESCALER : 0,
+				(unsigned long)stats.max*TIME_PRESCALER);
+			Serial_printLine(d_outBuff);
 		}
-		goto pgc_error;
+		cmdCursor = 0;
+		return OK;
 	}
-
-pgc_error:
-	return ERROR;
-pgc_ok:
+	
+	// WRITE "Profiler", only 0 (reset) allowed
+	ReadValueU(newValueU);
+	if (newValueU)
+		return ERROR;
+	profileReset();
 	return OK;
-
+#else
+	// Not compiled in
+	return ERROR;
+#endif
 }
 
-inline int parseOdoCmd(int type) {
+int regRam(uint8_t type, uint8_t write) {
+	
+	// READ  "RAM usage": stack peak, untouched, free
+	if (type == BINARY) {
+		framePut(ramStackPeak(), 2);
+		framePut(ramUntouched(), 2);
+		return framePut(ramFree(), 2);
+	}
+	ShowValueU(ramStackPeak());
+	ShowValueU(ramUntouched());
+	ShowValueU(ramFree());
+	return OK;
+}
 
-	switch(cmdRead()) {
-	case 'C':
-		switch(cmdRead()) { 
-		case 'P':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Pulse conunt"
-				ShowValueUL(d_pcount);
-				goto poc_ok;
-			case '=':
-				// WRITE "Pulse conunt"
-				cmdRead();
-				ReadValueUL(d_pcount);
-				goto poc_ok;
-			}
-			goto poc_error;
-		}
-		goto poc_error;
-	case 'F':
-		switch(cmdRead()) { 
-		case 'P':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Pulse frequency"
-				ShowValueUL(d_freq);
-				goto poc_ok;
+int regRules(uint8_t type, uint8_t write) {
+	derkgps_rule_t rule;
+	unsigned idx;
+	unsigned src, cmp, enter, leave, duration;
+	
+	if (!write) {
+		// READ  "Alarm rules", one enabled rule per line:
+		// idx,src,cmp,threshold,hysteresis,duration,enter,leave
+		for (idx=cmdCursor; idx<RULES_MAX; idx++) {
+			if (d_rules[idx].cmp == RULE_OFF)
+				continue;
+			if ( txFree(UART_AT) < CMD_LINE_ROOM ) {
+				cmdCursor = idx;
+				return CMD_PENDING;
 			}
-			goto poc_error;
+			snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE,
+				PSTR("%u,%u,%u,%lu,%lu,"), idx,
+				d_rules[idx].src, d_rules[idx].cmp,
+				d_rules[idx].threshold,
+				d_rules[idx].hysteresis);
+			Serial_printStr(d_outBuff);
+			snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE,
+				PSTR("%u,0x%02X,0x%02X"), d_rules[idx].duration,
+				d_rules[idx].enter, d_rules[idx].leave);
+			Serial_printLine(d_outBuff);
 		}
-		goto poc_error;
+		cmdCursor = 0;
+		return OK;
 	}
 	
-poc_error:
-	return ERROR;
-poc_ok:
+	// WRITE "Alarm rule":
+	// idx,src,cmp,threshold,hysteresis,duration,enter,leave
+	// a 0 (RULE_OFF) cmp disables the rule
+	cmdReadValue();
+	if (sscanf_P(d_outBuff, PSTR("%u,%u,%u,%lu,%lu,%u,%i,%i"), &idx, &src, &cmp,
+			&rule.threshold, &rule.hysteresis, &duration,
+			&enter, &leave) != 8 ||
+			idx >= RULES_MAX || src >= RULE_SRC_TOT ||
+			cmp > RULE_LT ||
+			!ruleEventValid(enter) || !ruleEventValid(leave))
+		return ERROR;
+	rule.src = src;
+	rule.cmp = cmp;
+	rule.duration = duration;
+	rule.enter = enter;
+	rule.leave = leave;
+	d_rules[idx] = rule;
+	resetRule(idx);
 	return OK;
+}
 
+int regRulesSave(uint8_t type, uint8_t write) {
+	
+	// WRITE "Alarm rules save", only 1 (save) allowed
+	ReadValueU(newValueU);
+	if (newValueU != 1)
+		return ERROR;
+	saveRules();
+	return OK;
 }
 
-inline int parseQueryCmd(int type) {
-	unsigned long events;
+int regSnapshot(uint8_t type, uint8_t write) {
+	at_snapshot_t snap;
 	
-	switch(cmdRead()) {
-	case 'C':
-		switch(cmdRead()) {
-		case 'M':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Continuous monitor"
-				ShowValueU(d_displayTime);
-				goto pqc_ok;
-			case '=':
-				// WRITE "Continuous monitor"
-				cmdRead();
-				ReadValueU(d_displayTime);
-				goto pqc_ok;
-			}
-			goto pqc_error;
+	// READ  "Snapshot"
+	cmdSnapshot(&snap);
+	
+	if (type == BINARY) {
+		framePut(snap.lat, 4);
+		framePut(snap.lon, 4);
+		framePut(snap.speed, 2);
+		framePut(snap.degree, 2);
+		framePut(snap.hdop, 2);
+		framePut(snap.fix, 1);
+		framePut(snap.events, 2);
+		framePut(snap.pcount, 4);
+		framePut(snap.freq, 4);
+		return framePut(snap.uptime, 4);
+	}
+	
+	// Fixed layout record:
+	// lat lon speed degree hdop fix pcount freq events uptime
+	snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE,
+		PSTR("%+011ld %+011ld %5u %5u %5u %1u "),
+		snap.lat, snap.lon, snap.speed,
+		snap.degree, snap.hdop, snap.fix);
+	Serial_printStr(d_outBuff);
+	snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE,
+		PSTR("%10lu %5lu 0x%04X %10lu"),
+		snap.pcount, snap.freq,
+		snap.events, snap.uptime);
+	Serial_printValue(d_outBuff);
+	return OK;
+}
+
+int regBaudRate(uint8_t type, uint8_t write) {
+	uint8_t port;
+	uint16_t ubrr;
+	uint8_t u2x;
+	
+	if (!write) {
+		// READ  "Baud Rates"
+		for (port=0; port<UART_NUM; port++) {
+			ShowValueUL(baudRate(port));
 		}
-		goto pqc_error;
-	case 'E':
-		switch(cmdRead()) {
-		case 'R':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Event register"
-				events = d_pendingEvents[EVENT_CLASS_GPS];
-				events <<= 8;
-				events |= d_pendingEvents[EVENT_CLASS_ODO];
-				snprintf(d_outBuff, OUTPUT_BUFFER_SIZE, "%lu 0x%02X%02X",
-						events,
-						d_pendingEvents[EVENT_CLASS_GPS],
-						d_pendingEvents[EVENT_CLASS_ODO]);
-// 				Serial_printLine(d_outBuff);
-				Serial_printValue(d_outBuff);
-				
-				// Resetting pending event
-				d_pendingEvents[EVENT_CLASS_GPS] = EVENT_NONE;
-				d_pendingEvents[EVENT_CLASS_ODO] = EVENT_NONE;
-				
-				// Releasgin interrupt pin
-				pinMode(intReq, INPUT);
-				
-				goto pqc_ok;
-			}
-			goto pqc_error;
+		return OK;
+	}
+	
+	// WRITE "Baud Rate": port,baud[,save]
+	// NOTE only the AT port could be changed: the GPS
+	//	receiver would keep sending at its own rate
+	cmdReadValue();
+	cmdBaudSave = 0;
+	if (sscanf_P(d_outBuff, PSTR("%u,%lu,%u"), &newValueU,
+			&cmdBaudRate, &cmdBaudSave) < 2 ||
+			newValueU != UART_AT ||
+			baudSetting(cmdBaudRate, &ubrr, &u2x) < 0)
+		return ERROR;
+	// NOTE the new baud rate is applied once the
+	//	command result has been sent
+	cmdBaudPort = newValueU;
+	return OK;
+}
+
+int regStats(uint8_t type, uint8_t write) {
+	uart_stats_t stats;
+	uint8_t port;
+	
+	if (!write) {
+		// READ  "UART Statistics"
+		// dropped, framing errors, overruns, peak, lines
+		// for each port
+		for (port=0; port<UART_NUM; port++) {
+			readStats(port, &stats);
+			ShowValueU(stats.dropped);
+			ShowValueU(stats.frameErr);
+			ShowValueU(stats.overrun);
+			ShowValueU(stats.peak);
+			ShowValueU(stats.lines);
 		}
-		goto pqc_error;
-	case 'I':
-		switch(cmdRead()) {
-		case 'T':
-			switch(cmdLook()) {
-			case LINE_TERMINATOR:
-				cmdRead();
-			case '+':
-				// READ  "Interrupt timeout"
-				ShowValueU(d_intrTimeout);
-				goto pqc_ok;
-			case '=':
-				// WRITE "Interrupt timeout"
-				cmdRead();
-				ReadValueU(d_intrTimeout);
-				goto pqc_ok;
-			}
-			goto pqc_error;
+		return OK;
+	}
+	
+	// WRITE "UART Statistics", only 0 (reset) allowed
+	ReadValueU(newValueU);
+	if (newValueU)
+		return ERROR;
+	for (port=0; port<UART_NUM; port++)
+		resetStats(port);
+	return OK;
+}
+
+/// A register descriptor, see AT_REGISTERS
+typedef struct {
+	char name[3];
+	uint8_t id;
+	uint8_t type;
+	uint8_t size;
+	uint8_t access;
+	uint8_t dec;
+	void *ptr;
+	void (*hook)(void);
+} at_reg_desc_t;
+
+typedef long (*reg_get_t)(void);
+typedef int (*reg_cmd_t)(uint8_t type, uint8_t write);
+
+#define REG_DESC(NAME, ID, TYPE, SIZE, ACCESS, DEC, PTR, HOOK)	\
+	{ #NAME, ID, TYPE, SIZE, ACCESS, DEC, (void *)(PTR), HOOK },
+
+/// The registers table
+const at_reg_desc_t regTable[] PROGMEM = {
+	AT_REGISTERS(REG_DESC)
+};
+
+#define REG_NUM	(sizeof(regTable)/sizeof(at_reg_desc_t))
+
+/// The descriptor of the register being accessed
+at_reg_desc_t cmdReg;
+
+/// Load into cmdReg the descriptor of the register named NAME
+/// @return ERROR if the register does not exist
+int regFindName(const char *name) {
+	uint8_t i;
+	
+	for (i=0; i<REG_NUM; i++) {
+		if ( !memcmp_P(name, regTable[i].name, 3) ) {
+			memcpy_P(&cmdReg, &regTable[i], sizeof(at_reg_desc_t));
+			return OK;
 		}
-		goto pqc_error;
 	}
+	return ERROR;
+}
 
-pqc_error:
+/// Load into cmdReg the descriptor of the register with binary ID
+/// @return ERROR if the register does not exist
+int regFindId(uint8_t id) {
+	uint8_t i;
+	
+	for (i=0; i<REG_NUM; i++) {
+		if ( pgm_read_byte(&regTable[i].id) == id ) {
+			memcpy_P(&cmdReg, &regTable[i], sizeof(at_reg_desc_t));
+			return OK;
+		}
+	}
 	return ERROR;
-pqc_ok:
-	return OK;
+}
 
+/// @return the value of a REG_Uxx or REG_FUNC register
+long regGet(void) {
+	
+	switch(cmdReg.type) {
+	case REG_U8:
+		return *(uint8_t *)cmdReg.ptr;
+	case REG_U16:
+		return *(uint16_t *)cmdReg.ptr;
+	case REG_U32:
+		return *(uint32_t *)cmdReg.ptr;
+	case REG_FUNC:
+		return ((reg_get_t)cmdReg.ptr)();
+	}
+	return 0;
 }
 
-inline int parseCmdClass(int type) {
-	switch(cmdRead()) {
-	case 'A':
-		// Alarms
-		return parseAlarmCmd(type);
-		break;
-	case 'G':
-		// GPS
-		return parseGpsCmd(type);
+/// Set the value of a REG_Uxx register, calling its write hook
+void regSet(unsigned long value) {
+	
+	switch(cmdReg.type) {
+	case REG_U8:
+		*(uint8_t *)cmdReg.ptr = value;
 		break;
-	case 'O':
-		// Odometer
-		return parseOdoCmd(type);
+	case REG_U16:
+		*(uint16_t *)cmdReg.ptr = value;
 		break;
-	case 'Q':
-		// Query registry
-		return parseQueryCmd(type);
+	case REG_U32:
+		*(uint32_t *)cmdReg.ptr = value;
 		break;
 	}
+	if (cmdReg.hook)
+		cmdReg.hook();
+}
+
+/// Decimal digits of fixed point values on AT replies, as formatDouble()
+#define REG_SHOW_DEC	4
+
+/// Show a register value on the AT interface
+void regShow(long value) {
+	unsigned long div;
+	unsigned long frac;
+	uint8_t i;
+	
+	if (cmdReg.type != REG_FUNC) {
+		ShowValueUL((unsigned long)value);
+		return;
+	}
+	if (value == FRAME_INVALID) {
+		Serial_printStr_P(PSTR("NA "));
+		return;
+	}
+	if (!cmdReg.dec) {
+		snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE, PSTR("%ld"), value);
+		Serial_printValue(d_outBuff);
+		return;
+	}
+	for (div=1, i=0; i<cmdReg.dec; i++)
+		div *= 10;
+	// Scaling the fraction to REG_SHOW_DEC digits, truncating the exceeding
+	// ones as formatDouble() did
+	frac = labs(value)%div;
+	for (i=cmdReg.dec; i<REG_SHOW_DEC; i++)
+		frac *= 10;
+	for (i=REG_SHOW_DEC; i<cmdReg.dec; i++)
+		frac /= 10;
+	snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE, PSTR("%c%lu.%0*lu"),
+			(value<0) ? '-' : '+',
+			labs(value)/div, REG_SHOW_DEC, frac);
+	Serial_printValue(d_outBuff);
+}
+
+/// Parse an AT register access, the leading '+' has been already read
+int parseRegister(void) {
+	unsigned long value;
+	char *end;
+	char name[3];
+	uint8_t i;
+	
+	for (i=0; i<3; i++)
+		name[i] = cmdRead();
+	if ( regFindName(name) != OK )
+		return ERROR;
+	
+	switch(cmdLook()) {
+	case LINE_TERMINATOR:
+		cmdRead();
+	case '+':
+		// READ
+		if ( !(cmdReg.access & REG_R) )
+			return ERROR;
+		if (cmdReg.type == REG_CMD)
+			return ((reg_cmd_t)cmdReg.ptr)(ASCII, 0);
+		regShow(regGet());
+		return OK;
+	case '=':
+		// WRITE
+		cmdRead();
+		if ( !(cmdReg.access & REG_W) )
+			return ERROR;
+		if (cmdReg.type == REG_CMD)
+			return ((reg_cmd_t)cmdReg.ptr)(ASCII, 1);
+		cmdReadValue();
+		value = strtoul(d_outBuff, &end, 10);
+		if (end == d_outBuff || *end)
+			return ERROR;
+		regSet(value);
+		return OK;
+	}
+	
 	return ERROR;
 }
 
 
-int parseCommand() {
-	int result = OK;
+//----- Subscriptions
+// Registers could be streamed without polling: each subscribed register is
+// sent every PERIOD [ms] or, if PERIOD is 0, as soon as its value changes
+// by more than DEADBAND. Fields due at the same time are sent on a single
+// unsolicited line:
+//	!NAME=value NAME=value ...
+
+/// Max number of subscribed registers
+#define SUBS_MAX	6
+
+/// A register subscription
+typedef struct {
+	uint8_t id;		///< Register binary ID, 0 if the entry is free
+	uint8_t sent;		///< 0 until the first value has been sent
+	uint16_t period;	///< Send period [ms], 0 for on-change
+	unsigned long deadband;	///< On-change min value variation
+	long value;		///< Last sent value
+	unsigned long time;	///< Last send time [ms]
+} at_sub_t;
+
+/// The subscriptions table
+at_sub_t cmdSubs[SUBS_MAX];
+
+/// Bytes of TX queue required to send a field: "NAME=" and a value
+#define SUBS_FIELD_SIZE	24
+
+int regSubscribe(uint8_t type, uint8_t write) {
+	unsigned long deadband = 0;
+	unsigned period = 0;
+	uint8_t free = SUBS_MAX;
+	uint8_t i;
+	int n;
 	
-	do {
-		switch(cmdRead()) {
-		case LINE_TERMINATOR:
-			// Be fair: return after a command line has been processed
-			break;
-		case '+':
-			result = parseCmdClass(ASCII);
-			break;
-		case '$':
-			result = parseCmdClass(BINARY);
+	if (!write) {
+		// READ  "Subscriptions": NAME,period,deadband for each one
+		for (i=cmdCursor; i<SUBS_MAX; i++) {
+			if ( !cmdSubs[i].id || regFindId(cmdSubs[i].id) != OK )
+				continue;
+			if ( txFree(UART_AT) < SUBS_FIELD_SIZE ) {
+				cmdCursor = i;
+				return CMD_PENDING;
+			}
+			snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE, PSTR("%.3s,%u,%lu"),
+					cmdReg.name, cmdSubs[i].period,
+					cmdSubs[i].deadband);
+			Serial_printValue(d_outBuff);
+		}
+		cmdCursor = 0;
+		return OK;
+	}
+	
+	// WRITE "Subscriptions": NAME,period[,deadband] to subscribe,
+	// NAME to unsubscribe, 0 to unsubscribe all
+	cmdReadValue();
+	if ( !strcmp_P(d_outBuff, PSTR("0")) ) {
+		memset(cmdSubs, 0, sizeof(cmdSubs));
+		return OK;
+	}
+	if ( strlen(d_outBuff) < 3 ||
+			regFindName(d_outBuff) != OK ||
+			cmdReg.type == REG_CMD ||
+			!(cmdReg.access & REG_R) )
+		return ERROR;
+	n = 0;
+	if (d_outBuff[3]) {
+		n = sscanf_P(d_outBuff+3, PSTR(",%u,%lu"), &period, &deadband);
+		if (n < 1)
+			return ERROR;
+	}
+	
+	for (i=0; i<SUBS_MAX; i++) {
+		if (cmdSubs[i].id == cmdReg.id)
 			break;
+		if (!cmdSubs[i].id && free == SUBS_MAX)
+			free = i;
+	}
+	if (!n) {
+		// Unsubscribe
+		if (i < SUBS_MAX)
+			cmdSubs[i].id = 0;
+		return OK;
+	}
+	if (i == SUBS_MAX)
+		i = free;
+	if (i == SUBS_MAX)
+		return ERROR;
+	
+	cmdSubs[i].id = cmdReg.id;
+	cmdSubs[i].sent = 0;
+	cmdSubs[i].period = period;
+	cmdSubs[i].deadband = deadband;
+	return OK;
+}
+
+void cmdStream(void) {
+	unsigned long now;
+	uint8_t fields = 0;
+	uint8_t due;
+	at_sub_t *sub;
+	long value;
+	uint8_t i;
+	
+	// Don't break a reply being sent
+	if ( cmdBusy() )
+		return;
+	
+	now = millis();
+	for (i=0; i<SUBS_MAX; i++) {
+		sub = &cmdSubs[i];
+		if ( !sub->id || regFindId(sub->id) != OK )
+			continue;
+		
+		value = regGet();
+		if (!sub->sent) {
+			due = 1;
+		} else if (sub->period) {
+			due = (now - sub->time) >= sub->period;
+		} else {
+			due = labs(value - sub->value) > sub->deadband;
 		}
+		if (!due)
+			continue;
 		
-		if (result!=OK) {
-			// Error on cmds parsing... aborting next commands
+		// Don't block on a busy UART: fields not sent are still due
+		// at next call
+		if ( txFree(UART_AT) < SUBS_FIELD_SIZE+2 )
 			break;
-		}
 		
-	} while ( cmdAvailable() );
+		if (!fields)
+			Serial_print('!');
+		snprintf_P(d_outBuff, OUTPUT_BUFFER_SIZE, PSTR("%.3s="), cmdReg.name);
+		Serial_printStr(d_outBuff);
+		regShow(value);
+		
+		sub->value = value;
+		sub->time = now;
+		sub->sent = 1;
+		fields++;
+	}
 	
-	Serial_printFlush();
-	Serial_printLine("");
-	if (result==OK)
-		Serial_printLine("OK");
-	else
-		Serial_printLine("ERROR");
+	if (fields)
+		Serial_printLine_P(PSTR(""));
+}
+
+
+//----- Binary protocol
+
+/// Append a little-endian value to the response frame
+/// @return ERROR if the frame is full
+int framePut(unsigned long value, uint8_t bytes) {
+	if ( frameLen+bytes > UART_FRAME_MAXLEN )
+		return ERROR;
+	for ( ; bytes; bytes--) {
+		frameBuff[frameLen++] = (uint8_t)value;
+		value >>= 8;
+	}
+	return OK;
+}
+
+/// Read a little-endian value from the request frame
+/// @return ERROR if the request does not contain that much bytes
+int frameGet(unsigned long *value, uint8_t bytes) {
+	uint8_t i;
 	
-	return result;
+	// NOTE the CRC16 is still to be read
+	if ( cmdAvailable() < bytes+2 )
+		return ERROR;
+	*value = 0;
+	for (i=0; i<bytes; i++)
+		*value |= ((unsigned long)cmdRead()) << (8*i);
+	return OK;
+}
+
+/// @return the register value size [bytes], 0 if the register does not
+///	exist or does not support the required access
+uint8_t frameRegSize(uint8_t id, uint8_t write) {
+	
+	if ( regFindId(id) != OK )
+		return 0;
+	if ( !(cmdReg.access & (write ? REG_W : REG_R)) )
+		return 0;
+	return cmdReg.size;
+}
+
+/// Append a register ID and its value to the response frame
+int frameReadReg(uint8_t id) {
+	
+	if ( !frameRegSize(id, 0) )
+		return ERROR;
+	if ( framePut(id, 1) != OK )
+		return ERROR;
+	if (cmdReg.type == REG_CMD)
+		return ((reg_cmd_t)cmdReg.ptr)(BINARY, 0);
+	return framePut(regGet(), cmdReg.size);
+}
+
+/// Write a register with the value following its ID into the request frame
+int frameWriteReg(uint8_t id) {
+	unsigned long value;
+	
+	if ( !frameRegSize(id, 1) )
+		return ERROR;
+	if (cmdReg.type == REG_CMD) {
+		if ( ((reg_cmd_t)cmdReg.ptr)(BINARY, 1) != OK )
+			return ERROR;
+	} else {
+		if ( frameGet(&value, cmdReg.size) != OK )
+			return ERROR;
+		regSet(value);
+	}
+	
+	return framePut(id|FRAME_WRITE, 1);
+}
+
+/// Send the response frame
+void frameSend(void) {
+	uint16_t crc = 0xFFFF;
+	uint8_t i;
+	
+	crc = _crc_xmodem_update(crc, frameLen);
+	for (i=0; i<frameLen; i++)
+		crc = _crc_xmodem_update(crc, frameBuff[i]);
+	
+	Serial_print(UART_FRAME_SYNC);
+	Serial_print(frameLen);
+	for (i=0; i<frameLen; i++)
+		Serial_print(frameBuff[i]);
+	Serial_print((uint8_t)crc);
+	Serial_print((uint8_t)(crc>>8));
+}
+
+/// Parse a binary request frame, the SYNC byte has been already read.
+/// Items are all checked before executing any of them: reads clearing
+/// registers and writes take effect only if the whole request succeeds.
+int parseFrame(void) {
+	uint16_t crc = 0xFFFF;
+	uint16_t rxCrc;
+	uint8_t start;
+	uint8_t mark;
+	int result;
+	uint8_t len;
+	uint8_t id;
+	uint8_t size;
+	uint8_t i;
+	
+	frameLen = 0;
+	
+	// Checking frame integrity: LEN ITEMS[LEN] CRC16
+	id = 0;
+	len = cmdRead();
+	if ( cmdAvailable() != len+2 )
+		goto pf_nak;
+	crc = _crc_xmodem_update(crc, len);
+	for (i=0; i<len; i++)
+		crc = _crc_xmodem_update(crc, lineChar(&cmdLine, cmdPos+i));
+	rxCrc  = lineChar(&cmdLine, cmdPos+len);
+	rxCrc |= lineChar(&cmdLine, cmdPos+len+1) << 8;
+	if ( rxCrc != crc )
+		goto pf_nak;
+	
+	// Checking items and the response size, the CRC16 excluded
+	start = cmdPos;
+	size = 0;
+	while ( cmdAvailable() > 2 ) {
+		id = cmdRead();
+		i = frameRegSize(id & ~FRAME_WRITE, id & FRAME_WRITE);
+		if ( !i )
+			goto pf_nak;
+		if ( id & FRAME_WRITE ) {
+			if ( cmdAvailable() < i+2 )
+				goto pf_nak;
+			cmdPos += i;
+			// The ID, or a NAK item if the write fails
+			size += 2;
+		} else {
+			size += 1+i;
+		}
+		if ( size > UART_FRAME_MAXLEN )
+			goto pf_nak;
+	}
 	
+	// Executing items
+	cmdPos = start;
+	while ( cmdAvailable() > 2 ) {
+		id = cmdRead();
+		start = cmdPos;
+		mark = frameLen;
+		if ( id & FRAME_WRITE ) {
+			size = frameRegSize(id & ~FRAME_WRITE, 1);
+			result = frameWriteReg(id & ~FRAME_WRITE);
+			// NOTE a failed write could have not consumed its whole
+			// value: the next item always follows it
+			cmdPos = start + size;
+		} else {
+			result = frameReadReg(id);
+		}
+		if ( result != OK ) {
+			// Replacing a partial response with a NAK item
+			frameLen = mark;
+			framePut(FRAME_NAK, 1);
+			framePut(id, 1);
+		}
+	}
+	
+	frameSend();
+	return OK;
+	
+pf_nak:
+	frameLen = 0;
+	framePut(FRAME_NAK, 1);
+	framePut(id, 1);
+	frameSend();
+	return ERROR;
+}
+
+/// Parse queued command lines, up to CMD_LINES for each call.
+/// Only complete lines are parsed; the parser never blocks on a busy UART:
+/// if the TX queue has not enough room, parsing is suspended and resumed
+/// by the next call from where it was left.
+/// @return the result of the last completed command line
+int parseCommand() {
+	uint8_t start;
+	uint8_t lines;
+	int result = OK;
+	
+	for (lines=0; lines<CMD_LINES; lines++) {
+		
+		if (cmdState == CMD_IDLE) {
+			if ( !lookLine(UART_AT, &cmdLine) )
+				break;
+			cmdPos = 0;
+			
+			// Binary requests are answered only by a binary frame
+			if ( lineChar(&cmdLine, 0) == UART_FRAME_SYNC ) {
+				if ( txFree(UART_AT) < UART_FRAME_MAXLEN+4 )
+					break;
+				cmdPos = 1;
+				result = parseFrame();
+				releaseLine(UART_AT);
+				continue;
+			}
+			
+			cmdResult = OK;
+			cmdState = CMD_PARSING;
+		}
+		
+		// On errors next commands are skipped
+		while ( cmdResult == OK && cmdAvailable() ) {
+			if ( cmdLook() != '+' ) {
+				// Skipping separators and the line terminator
+				cmdRead();
+				continue;
+			}
+			if ( txFree(UART_AT) < CMD_TX_ROOM )
+				return result;
+			start = cmdPos;
+			cmdRead();
+			cmdResult = parseRegister();
+			if ( cmdResult == CMD_PENDING ) {
+				// The register is parsed again once the TX queue
+				// has been drained
+				cmdPos = start;
+				cmdResult = OK;
+				return result;
+			}
+		}
+		
+		if ( txFree(UART_AT) < CMD_RESULT_ROOM )
+			return result;
+		
+		releaseLine(UART_AT);
+		cmdState = CMD_IDLE;
+		result = cmdResult;
+		
+		Serial_printLine_P(PSTR(""));
+		if (result==OK)
+			Serial_printLine_P(PSTR("OK"));
+		else
+			Serial_printLine_P(PSTR("ERROR"));
+		
+		// Switching baud rate only after the result has been sent at the
+		// old one
+		if (cmdBaudPort != UART_NUM && result==OK) {
+			setBaudRate(cmdBaudPort, cmdBaudRate);
+			if (cmdBaudSave)
+				saveBaudRate(cmdBaudPort);
+		}
+		cmdBaudPort = UART_NUM;
+	}
+	
+	return result;
 }
@@ -31,6 +31,171 @@
 #define ASCII	0
 #define BINARY	1
 
+//----- Binary protocol
+// Both requests and responses are frames:
+//	'$' LEN ITEMS[LEN] CRC16
+// where CRC16 is the little-endian CRC-16/CCITT (poly 0x1021, init 0xFFFF)
+// of LEN and ITEMS. Request items are a register ID, to read it, or a
+// register ID ORed with FRAME_WRITE followed by the new value. Response items
+// are the read register IDs followed by their value, and the written ones.
+// All values are little-endian integers; an invalid request (bad CRC,
+// unknown IDs, wrong sizes) is answered by a FRAME_NAK item followed by
+// the offending ID (0 on CRC errors), and none of its items is executed.
+// An item of a valid request which fails while being executed, e.g. a
+// refused value, is answered by a FRAME_NAK item followed by its ID, while
+// the other items are executed.
+#define FRAME_WRITE	0x80
+#define FRAME_NAK	0xFF
+
+//----- Registers
+// Each register is served both by the AT and the binary protocol:
+//	X(NAME, ID, TYPE, SIZE, ACCESS, DEC, PTR, HOOK)
+// NAME	is the AT command name, i.e. "+NAME" to read it, "+NAME=x" to write it
+// ID	is the binary protocol register ID
+// TYPE	defines what PTR points to:
+//	REG_U8/16/32	an unsigned variable of that size
+//	REG_FUNC	a "long fn(void)" getter, returning FRAME_INVALID if the
+//			value is not available
+//	REG_CMD		an "int fn(uint8_t type, uint8_t write)" handler, which
+//			parses and formats the value by itself
+// SIZE	is the binary value size [bytes], 0 if not available on binary frames
+// ACCESS	is REG_R, REG_W or REG_RW
+// DEC	are the decimal digits of REG_FUNC values (fixed point): AT replies
+//	always show them with 4 decimals, as the floating point ones did
+// HOOK	is a "void fn(void)" called after each write, or 0
+// Binary values are: [unit] size
+#define AT_REGISTERS(X)								\
+	/* Emergency Break [Hz/s]		U32 */				\
+	X(AEB, 0x01, REG_U32,  4, REG_RW, 0, &d_rules[RULE_BREAK].threshold, regBreakHook) \
+	/* Pulse Count Interrupt [pulses]	U16 */				\
+	X(APC, 0x02, REG_U16,  2, REG_RW, 0, &d_distIntrPCount, regDistHook)	\
+	/* Speed Limit [Hz]			U32 */				\
+	X(ASL, 0x03, REG_U32,  4, REG_RW, 0, &d_rules[RULE_SPEED].threshold, regSpeedHook) \
+	/* Fix value				U8 */				\
+	X(GFV, 0x10, REG_FUNC, 1, REG_R,  0, regGpsFix, 0)			\
+	/* Ground speed [10 m/h]		U16 */				\
+	X(GGS, 0x11, REG_FUNC, 2, REG_R,  2, regGpsSpeed, 0)			\
+	/* HDOP [1/100]				U16 */				\
+	X(GHP, 0x12, REG_FUNC, 2, REG_R,  2, regGpsHdop, 0)			\
+	/* Latitude [10^-6 deg]			S32 */				\
+	X(GLA, 0x13, REG_FUNC, 4, REG_R,  6, regGpsLat, 0)			\
+	/* Longitude [10^-6 deg]		S32 */				\
+	X(GLO, 0x14, REG_FUNC, 4, REG_R,  6, regGpsLon, 0)			\
+	/* Power State				U8 */				\
+	X(GPS, 0x15, REG_U16,  1, REG_RW, 0, &d_gpsPowerState, 0)		\
+	/* GPS Command				U8 */				\
+	X(GSC, 0x16, REG_U16,  1, REG_W,  0, &d_gpsNextCmd, 0)		\
+	/* Track Degree [1/100 deg]		U16 */				\
+	X(GTD, 0x17, REG_FUNC, 2, REG_R,  2, regGpsDegree, 0)		\
+	/* Total pulse count [pulses]		U32 */				\
+	X(OCP, 0x20, REG_CMD,  4, REG_RW, 0, regPulseCount, 0)		\
+	/* Pulse frequency [Hz]			U32 */				\
+	X(OFP, 0x21, REG_U32,  4, REG_R,  0, &d_freq, 0)			\
+	/* Pulse frequency [mHz]		U32 */				\
+	X(OFM, 0x22, REG_U32,  4, REG_R,  0, &d_freqMilli, 0)		\
+	/* Frequency method: 0 count, 1 period	U8 */				\
+	X(OPM, 0x23, REG_U8,   1, REG_R,  0, &d_odoPeriodMode, 0)		\
+	/* Pulses per km, 0 if not calibrated	U32 */				\
+	X(OPK, 0x24, REG_U32,  4, REG_RW, 0, &d_ppk, regPpkHook)		\
+	/* Speed [cm/s], invalid: 0x7FFFFFFF	U32 */				\
+	X(OSI, 0x25, REG_FUNC, 4, REG_R,  0, regOdoSpeed, 0)			\
+	/* Distance [m], invalid: 0x7FFFFFFF	U32 */				\
+	X(ODM, 0x26, REG_FUNC, 4, REG_R,  0, regOdoDistance, 0)		\
+	/* Acceleration [mm/s^2]		S32 */				\
+	X(OAC, 0x27, REG_FUNC, 4, REG_R,  3, regOdoAccel, 0)			\
+	/* Update window max pulses		U16 */				\
+	X(OWP, 0x28, REG_U16,  2, REG_RW, 0, &d_odoWindowPulses, 0)		\
+	/* Update window max time [ms]		U16 */				\
+	X(OWT, 0x29, REG_U16,  2, REG_RW, 0, &d_odoWindowTime, 0)		\
+	/* Odometer log last sequence number	U32 */				\
+	X(OLS, 0x2A, REG_FUNC, 4, REG_R,  0, regOdoLogSeq, 0)			\
+	/* Resets by brown-out			U16 */				\
+	X(OBO, 0x2B, REG_U16,  2, REG_R,  0, &d_brownouts, 0)			\
+	/* Continuous monitor [s]		U16 */				\
+	X(QCM, 0x30, REG_U16,  2, REG_RW, 0, &d_displayTime, 0)		\
+	/* Event register (cleared on read)	U16 */				\
+	X(QER, 0x31, REG_CMD,  2, REG_R,  0, regEvents, 0)			\
+	/* Interrupt timeout [ms]		U16 */				\
+	X(QIT, 0x32, REG_U16,  2, REG_RW, 0, &d_intrTimeout, 0)		\
+	/* Snapshot of the live registers	29 bytes:			\
+	 * S32 lat, S32 lon, U16 speed, U16 degree, U16 hdop, U8 fix,		\
+	 * U16 events (not ACKed), U32 pcount, U32 freq, U32 uptime [ms] */	\
+	X(QSN, 0x33, REG_CMD, 29, REG_R,  0, regSnapshot, 0)			\
+	/* Baud rates, AT only: port,baud[,save] */				\
+	X(QBR, 0x34, REG_CMD,  0, REG_RW, 0, regBaudRate, 0)			\
+	/* UART statistics, AT only: 0 to reset */				\
+	X(QUS, 0x35, REG_CMD,  0, REG_RW, 0, regStats, 0)			\
+	/* Subscriptions, AT only: NAME,period[,deadband] */			\
+	X(QSB, 0x36, REG_CMD,  0, REG_RW, 0, regSubscribe, 0)			\
+	/* Monitor format: 0 full, 1 delta	U8 */				\
+	X(QMF, 0x37, REG_U8,   1, REG_RW, 0, &d_displayMode, regDisplayHook)	\
+	/* Delta monitor keyframe period [periods]	U16 */			\
+	X(QKF, 0x38, REG_U16,  2, REG_RW, 0, &d_displayKeyframe, regDisplayHook) \
+	/* Delta monitor threshold			U16 */			\
+	X(QDT, 0x39, REG_U16,  2, REG_RW, 0, &d_displayDelta, 0)		\
+	/* Oldest event record, removed on read	24 bytes:			\
+	 * U8 class, U8 event, U32 time [ms], U32 pcount, U32 freq,		\
+	 * U16 speed [10 m/h], S32 lat, S32 lon [10^-6 deg] */			\
+	X(QEV, 0x3A, REG_CMD, EVENT_REC_SIZE, REG_R, 0, regEventQueue, 0)	\
+	/* Queued event records		U8 */				\
+	X(QEN, 0x3B, REG_FUNC, 1, REG_R,  0, regEventCount, 0)		\
+	/* Event records lost on overflow	U16 */				\
+	X(QEO, 0x3C, REG_U16,  2, REG_RW, 0, &d_eventOverflow, 0)		\
+	/* Alarm rules, AT only:						\
+	 * idx,src,cmp,threshold,hysteresis,duration,enter,leave */		\
+	X(ARU, 0x04, REG_CMD,  0, REG_RW, 0, regRules, 0)			\
+	/* Alarm rules save, AT only: 1 to save into EEPROM */			\
+	X(ARS, 0x05, REG_CMD,  0, REG_W,  0, regRulesSave, 0)			\
+	/* Interrupt holdoff [ms]		U16 */				\
+	X(QIH, 0x3D, REG_U16,  2, REG_RW, 0, &d_intrHoldoff, 0)		\
+	/* Interrupt min released gap [ms]	U16 */				\
+	X(QIG, 0x3E, REG_U16,  2, REG_RW, 0, &d_intrGap, 0)			\
+	/* Interrupt statistics, 0 to reset	3 x U16:			\
+	 * asserted, coalesced, expired */					\
+	X(QIS, 0x3F, REG_CMD,  6, REG_RW, 0, regIntrStats, 0)		\
+	/* Tasks statistics, AT only: 0 to reset,				\
+	 * id,runs,misses,avg [us],max [us] per task */			\
+	X(QTS, 0x40, REG_CMD,  0, REG_RW, 0, regTasks, 0)			\
+	/* CPU idle [1/10 %]			U16 */				\
+	X(QID, 0x41, REG_FUNC, 2, REG_R,  1, regIdleLoad, 0)			\
+	/* Profiler, AT only, if PROFILE is defined: 0 to reset,		\
+	 * stage,count,min,avg,max [cycles] per stage */			\
+	X(QPF, 0x42, REG_CMD,  0, REG_RW, 0, regProfile, 0)			\
+	/* RAM usage [bytes]			3 x U16:			\
+	 * stack peak, never used by the stack, currently free */		\
+	X(QRM, 0x43, REG_CMD,  6, REG_R,  0, regRam, 0)
+
+// Register types
+#define REG_U8		1
+#define REG_U16		2
+#define REG_U32		3
+#define REG_FUNC	4
+#define REG_CMD		5
+
+// Register access
+#define REG_R		0x1
+#define REG_W		0x2
+#define REG_RW		(REG_R|REG_W)
+
+/// Binary protocol registers
+#define REG_ENUM(NAME, ID, TYPE, SIZE, ACCESS, DEC, PTR, HOOK)	REG_##NAME = ID,
+typedef enum {
+	AT_REGISTERS(REG_ENUM)
+} at_reg_t;
+
+// Command parser states
+#define CMD_IDLE	0
+#define CMD_PARSING	1
+
+extern uint8_t cmdState;
+
+/// Not-null while a command line is being parsed, and thus its reply is
+/// still to be completed
+#define cmdBusy()	(cmdState != CMD_IDLE)
+
 int parseCommand();
 
+/// Send subscribed registers which are due
+void cmdStream(void);
+
 #endif
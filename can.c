@@ -21,6 +21,7 @@ Boston, MA  02111-1307  USA
 */
 
 #include "can.h"
+#include "profile.h"
 
 /*_____ C O N S T A N T E S - D E F I N I T I O N  ___________________________*/
 
@@ -119,7 +120,9 @@ unsigned int  canAckGenErrCount = 0;	//	Acknowledgment Error
 unsigned int  canForGenErrCount = 0;	//	Form Error
 unsigned int  canCrcGenErrCount = 0;	//	CRC Error
 unsigned int  canStuGenErrCount = 0;	//	Stuff Error
-unsigned int canBusOffCount = 0;	//	Bus Off Interrupt Flag
+volatile unsigned int canBusOffCount = 0;	//	Bus Off Interrupt Flag
+// Bus Off interrupts already reported on the UART
+unsigned int canBusOffShown = 0;
 
 unsigned int  numMObTx;		// MOb number with TxOK
 unsigned int  numMObRx;		// MOb number with RxOK
@@ -302,6 +305,25 @@ unsigned char canFindFirstChIt (void) {
 }
 
 
+// Report the Bus Off interrupts counted since last call.
+// NOTE the UART could block: it must not be used by the CAN ISR, which would
+// delay all other ISRs, e.g. the odometer edges timestamps
+static void canBusOffReport (void) {
+    unsigned int count;
+    uint8_t sreg;
+    
+    sreg = SREG;
+    cli();
+    count = canBusOffCount;
+    SREG = sreg;
+    
+    if ( count != canBusOffShown ) {
+	canBusOffShown = count;
+	Serial_printLine_P(PSTR("\r\n  CAN Error Bus Off "));
+    }
+    
+}
+
 static void readOnMOb0 (void) {
     canChannelConf_t conf;
     canMsg_t canRxMsg;
@@ -339,6 +361,7 @@ static void readOnMOb0 (void) {
 digitalWrite(led1, HIGH);
     while ( canFlags == 0x00 ) {
 	/* Waiting for a CAN Message */;
+	canBusOffReport();
     }
 digitalWrite(led1, LOW);
 	
@@ -353,16 +376,16 @@ digitalWrite(led1, LOW);
     
     // Print ID
     if ( canRxMsg.ctrl & CONF_IDE ) {
-	snprintf(canDebugBuff, 32, "Ch-%d %08lX ",
+	snprintf_P(canDebugBuff, 32, PSTR("Ch-%d %08lX "),
 	    numMObRx, canRxMsg.id.ext);
     } else {
-	snprintf(canDebugBuff, 32, "Ch-%d %04X ",
+	snprintf_P(canDebugBuff, 32, PSTR("Ch-%d %04X "),
 	    numMObRx, canRxMsg.id.std);
     }
     Serial_printStr(canDebugBuff);
     
     // Print DATA
-    snprintf(canDebugBuff, 32, "%02X %02x %02x %02x %02X %02x %02x %02x",
+    snprintf_P(canDebugBuff, 32, PSTR("%02X %02x %02x %02x %02X %02x %02x %02x"),
 	      canRxMsg.pData[7],
 	      canRxMsg.pData[6],
 	      canRxMsg.pData[5],
@@ -394,6 +417,7 @@ SIGNAL(SIG_CAN_INTERRUPT1) {
     unsigned char ch;
     unsigned char savedCanPage;
     unsigned char error;
+    PROFILE_BEGIN(PROF_ISR_CAN);
     
     // Save the current page
     savedCanPage = CANPAGE;
@@ -464,8 +488,8 @@ digitalSwitch(led2);
 	}
 	
 	if ( tbi(CANGIT,BOFFIT)) {
+	    // Reported by canBusOffReport()
 	    canBusOffCount++;
-	    Serial_printLine("\r\n  CAN Error Bus Off ");
 	    // Reset Int_Bus_Off done in (global) IT_Handler
 	}
 	
@@ -476,6 +500,7 @@ digitalSwitch(led2);
     // Restore the previous page
     CANPAGE = savedCanPage;
     
+    PROFILE_END(PROF_ISR_CAN);
 }
 
 SIGNAL(SIG_CAN_OVERFLOW1) {
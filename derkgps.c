@@ -20,7 +20,14 @@
 
 */
 
+#include <math.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+
 #include "derkgps.h"
+#include "odolog.h"
+#include "sched.h"
+#include "profile.h"
 // #include "gps.h"
 // #include "atinterface.h"
 
@@ -42,33 +49,46 @@
 #define DERKGPS_INTR_LEN        200
 
 //----- ODOMETER
-/// Odometer pulses count
-unsigned long d_pcount = 0;
 /// Last computed odometer pulses frequency
 unsigned long d_freq = 0;
-/// The old freq value used for Alarms Checking
-unsigned d_oldFreq = 0;
+/// Last computed odometer pulses frequency [mHz]
+unsigned long d_freqMilli = 0;
+/// Not-null if the frequency is measured by the pulses period, else it is
+/// measured by the pulses count within the update window
+uint8_t d_odoPeriodMode = 0;
 
-/// Current max [ppm/s] EVENT_OVER_SPEED alarm
-unsigned long d_minOverSpeed = 0;
-/// Current max [ppm/s] decelleration EVENT_EMERGENCY_BREAK alarm
-unsigned long d_minEmergencyBreak = 0;
 /// Pulses between distance interrupts
 unsigned d_distIntrPCount = 0;
+/// Odometer pulses per km, 0 if not yet calibrated
+unsigned long d_ppk = 0;
+/// The pulses per km saved into EEPROM
+uint32_t EEMEM eePpk;
 
 
-/// Frequency variation since last check [Hz]
-long d_df = 0;
-/// Time interval between last two update [s]
+/// Filtered frequency derivative [mHz/s]
+long d_freqRate = 0;
+/// Filtered acceleration [mm/s^2], 0 if not calibrated
+long d_accel = 0;
+/// Time interval between last two update [ms]
 unsigned long d_dt = 0;
 /// Last update time [ms]
 unsigned long d_odoLastUpdate = 0;
-/// Pulses of next distance interrupt
-unsigned long d_distIntrNext = 0;
+/// The update window closes after these pulses...
+unsigned d_odoWindowPulses = 32;
+/// ...or this time [ms], whichever comes first
+unsigned d_odoWindowTime = 511;
 
 //----- AT Interface
 /// Delay ~[s] between dispaly monitor sentences, if 0 DISABLED (default 0);
 unsigned d_displayTime = 1;
+/// Monitor format: 0 full lines, 1 delta lines
+uint8_t d_displayMode = 0;
+/// Delta monitor: periods between two full lines (keyframes)
+unsigned d_displayKeyframe = 10;
+/// Delta monitor: min count, freq [Hz] and position [10^-4 deg] variation
+unsigned d_displayDelta = 0;
+/// Delta monitor: periods to next keyframe
+unsigned d_displayCount = 0;
 /// Buffer for sentence display formatting
 char d_displayBuff[OUTPUT_BUFFER_SIZE];
 /// ATinterface top-halves Interrupt scheduling flags
@@ -80,22 +100,42 @@ short d_thIntrCMD = 0;
 ///// Events enabled to generate signals
 //derkgps_event_t d_activeEvents[EVENT_CLASS_TOT] = {EVENT_NONE, EVENT_NONE}; // Disabling all interrupts by default
 derkgps_event_t d_activeEvents[EVENT_CLASS_TOT] = { 0x3F, 0x03 };
-/// Events suspended by this code to avoid interrupt storms
-derkgps_event_t d_suspendedEvents[EVENT_CLASS_TOT] = {EVENT_NONE, EVENT_NONE};
 /// Events pending to be ACKed
 derkgps_event_t d_pendingEvents[EVENT_CLASS_TOT] = {EVENT_NONE, EVENT_NONE};
-/// Time to reset interrupt line if not readed before [ms]
-unsigned long d_intrResetTime = 0;
+/// Event records queue
+derkgps_event_rec_t d_eventQueue[EVENT_QUEUE_SIZE];
+/// Next record to read
+uint8_t d_eventHead = 0;
+/// Queued records
+uint8_t d_eventCount = 0;
+/// Records overwritten before being read
+uint16_t d_eventOverflow = 0;
 /// How long an interrupt last [ms]
 unsigned d_intrTimeout = 30000;
+/// Min time between two interrupts [ms], events notified within this
+/// window are coalesced into a single interrupt sent at the window end
+unsigned d_intrHoldoff = 0;
+/// Min time the interrupt line is released before being asserted again [ms]
+unsigned d_intrGap = 0;
+/// Not-null while the interrupt line is asserted
+uint8_t d_intrAsserted = 0;
+/// Not-null if an interrupt has been delayed by the holdoff or gap windows
+uint8_t d_intrDeferred = 0;
+/// Last interrupt assertion time [ms]
+unsigned long d_intrAssertTime = 0;
+/// Last interrupt release time [ms]
+unsigned long d_intrReleaseTime = 0;
+/// Not-null once the interrupt line has been asserted, enabling the holdoff
+/// and gap windows; unlike d_intrStats it is never reset
+uint8_t d_intrEverAsserted = 0;
+/// Interrupt statistics
+derkgps_intr_stats_t d_intrStats;
 
 //----- GPS DATA
 /// The GPS power state: 1=ON, 0=OFF
 unsigned d_gpsPowerState = 0;
 /// The next command to send to the GPS (0=don't send any command)
 unsigned d_gpsNextCmd = 0;
-/// The old fix value used for Alarms Checking
-unsigned d_oldFix = FIX_INVALID;
 /// GPS top-halves Interrupt scheduling flags
 short d_thIntrGPS = 0;
 
@@ -117,31 +157,192 @@ void formatDouble(double val, char *buf, int len) {
 	fractal = (long)(((double)val-(double)integer)*(double)10000);
 	fractal = (fractal<0) ? -fractal : fractal;
 	
-	snprintf(buf, len, "%+ld.%04ld", integer, fractal);
+	snprintf_P(buf, len, PSTR("%+ld.%04ld"), integer, fractal);
 }
 
 //----- Display monitor
+// Full lines are:
+//	0xGGOO count freq siv fix hdop lat lon
+// Delta lines (d_displayMode=1) are:
+//	~MM fields...
+// where MM is the hex mask of the fields which follow, in the same order
+// and format of a full line; a full line (keyframe) is sent every
+// d_displayKeyframe periods.
+#define MON_EVENTS	0x01
+#define MON_COUNT	0x02
+#define MON_FREQ	0x04
+#define MON_SIV		0x08
+#define MON_FIX		0x10
+#define MON_HDOP	0x20
+#define MON_LAT		0x40
+#define MON_LON		0x80
+
+/// Lat/lon of a non valid position: out of range, while 0 is valid
+#define MON_POS_INVALID	0x7FFFFFFF
+
+/// Max delta line size, including the line terminator
+#define DISPLAY_DELTA_SIZE	64
+
+/// The monitored values
+typedef struct {
+	uint16_t events;
+	unsigned long count;
+	unsigned long freq;
+	unsigned siv;
+	unsigned fix;
+	char hdop;
+	long lat;	///< [10^-4 deg], MON_POS_INVALID if not valid
+	long lon;	///< [10^-4 deg], MON_POS_INVALID if not valid
+} derkgps_monitor_t;
+
+/// Last sent monitor values
+derkgps_monitor_t d_displayLast;
+
+/// Not-null iff A and B differs by more than d_displayDelta
+#define MON_CHANGED(A, B)	\
+	(((A)>(B) ? (A)-(B) : (B)-(A)) > d_displayDelta)
+
+/// Not-null iff the validity or the value of coordinates A and B differs
+#define MON_POS_CHANGED(A, B)					\
+	(((A) == MON_POS_INVALID) != ((B) == MON_POS_INVALID) ||	\
+		MON_CHANGED(A, B))
+
+void displayDelta(derkgps_monitor_t *mon) {
+	uint8_t mask = 0;
+	
+	if (mon->events != d_displayLast.events)
+		mask |= MON_EVENTS;
+	if (MON_CHANGED(mon->count, d_displayLast.count))
+		mask |= MON_COUNT;
+	if (MON_CHANGED(mon->freq, d_displayLast.freq))
+		mask |= MON_FREQ;
+	if (mon->siv != d_displayLast.siv)
+		mask |= MON_SIV;
+	if (mon->fix != d_displayLast.fix)
+		mask |= MON_FIX;
+	if (mon->hdop != d_displayLast.hdop)
+		mask |= MON_HDOP;
+	if (MON_POS_CHANGED(mon->lat, d_displayLast.lat))
+		mask |= MON_LAT;
+	if (MON_POS_CHANGED(mon->lon, d_displayLast.lon))
+		mask |= MON_LON;
+	
+	// Nothing changed: nothing to send
+	if (!mask)
+		return;
+	
+	snprintf_P(d_displayBuff, OUTPUT_BUFFER_SIZE, PSTR("~%02X"), mask);
+	Serial_printStr(d_displayBuff);
+	
+	if (mask & MON_EVENTS) {
+		snprintf_P(d_displayBuff, OUTPUT_BUFFER_SIZE, PSTR(" 0x%04X"),
+				mon->events);
+		Serial_printStr(d_displayBuff);
+		d_displayLast.events = mon->events;
+	}
+	if (mask & MON_COUNT) {
+		snprintf_P(d_displayBuff, OUTPUT_BUFFER_SIZE, PSTR(" %8lu"),
+				mon->count);
+		Serial_printStr(d_displayBuff);
+		d_displayLast.count = mon->count;
+	}
+	if (mask & MON_FREQ) {
+		snprintf_P(d_displayBuff, OUTPUT_BUFFER_SIZE, PSTR(" %4lu"),
+				mon->freq);
+		Serial_printStr(d_displayBuff);
+		d_displayLast.freq = mon->freq;
+	}
+	if (mask & MON_SIV) {
+		snprintf_P(d_displayBuff, OUTPUT_BUFFER_SIZE, PSTR(" %2u"),
+				mon->siv);
+		Serial_printStr(d_displayBuff);
+		d_displayLast.siv = mon->siv;
+	}
+	if (mask & MON_FIX) {
+		snprintf_P(d_displayBuff, OUTPUT_BUFFER_SIZE, PSTR(" %1u"),
+				mon->fix);
+		Serial_printStr(d_displayBuff);
+		d_displayLast.fix = mon->fix;
+	}
+	if (mask & MON_HDOP) {
+		snprintf_P(d_displayBuff, OUTPUT_BUFFER_SIZE, PSTR(" %1c"),
+				mon->hdop);
+		Serial_printStr(d_displayBuff);
+		d_displayLast.hdop = mon->hdop;
+	}
+	if (mask & MON_LAT) {
+		Serial_print(' ');
+		if (mon->lat != MON_POS_INVALID) {
+			formatDouble(gpsLat(), d_displayBuff, 9);
+			Serial_printStr(d_displayBuff);
+		} else {
+			Serial_printStr_P(PSTR("NA"));
+		}
+		d_displayLast.lat = mon->lat;
+	}
+	if (mask & MON_LON) {
+		Serial_print(' ');
+		if (mon->lon != MON_POS_INVALID) {
+			formatDouble(gpsLon(), d_displayBuff, 10);
+			Serial_printStr(d_displayBuff);
+		} else {
+			Serial_printStr_P(PSTR("NA"));
+		}
+		d_displayLast.lon = mon->lon;
+	}
+	
+	Serial_printLine_P(PSTR(""));
+}
+
 void display(void) {
-// 	unsigned long cc = d_pcount;
-	unsigned long cc = odoPulseCount();
-	unsigned long cf = d_freq;
+	derkgps_monitor_t mon;
 	unsigned long time = millis();
 	uint8_t ge = d_pendingEvents[EVENT_CLASS_GPS];
 	uint8_t oe = d_pendingEvents[EVENT_CLASS_ODO];
-	unsigned siv = gpsSatInView();
-	unsigned fix = gpsFix();
-	char hdop = gpsHdopLevel();
 	
 	time -= d_displayLastUpdate;
 	if ( time < (d_displayTime*1000) ) {
 		return;
 	}
 	
+	// Don't block the main loop on a busy UART or break a command
+	// reply: if the line does not fit the TX queue we retry at next loop
+	if ( cmdBusy() || txFree(UART_AT) < (d_displayMode ?
+			DISPLAY_DELTA_SIZE : OUTPUT_BUFFER_SIZE+2) ) {
+		return;
+	}
+	
+	mon.events = ((uint16_t)ge << 8) | oe;
+	mon.count = odoPulseCount();
+	mon.freq = d_freq;
+	mon.siv = gpsSatInView();
+	mon.fix = gpsFix();
+	mon.hdop = gpsHdopLevel();
+	if (gpsIsPosValid()) {
+		mon.lat = (long)(gpsLat()*10000);
+		mon.lon = (long)(gpsLon()*10000);
+	} else {
+		mon.lat = MON_POS_INVALID;
+		mon.lon = MON_POS_INVALID;
+	}
+	
+	d_displayLastUpdate = millis();
+	
+	if (d_displayMode && d_displayCount) {
+		d_displayCount--;
+		displayDelta(&mon);
+		return;
+	}
+	
+	// Keyframe
+	d_displayLast = mon;
+	d_displayCount = d_displayKeyframe;
+	
 	if (gpsIsPosValid()) {
 		// 28 Bytes for this first part
-		snprintf(d_displayBuff, OUTPUT_BUFFER_SIZE,
-			"0x%02X%02X %8lu %4lu %2u %1u %1c ",
-			ge, oe, cc, cf, siv, fix, hdop);
+		snprintf_P(d_displayBuff, OUTPUT_BUFFER_SIZE,
+			PSTR("0x%02X%02X %8lu %4lu %2u %1u %1c "),
+			ge, oe, mon.count, mon.freq, mon.siv, mon.fix, mon.hdop);
 		// This is what we have to append: "+99.9999 +999.9999"
 		formatDouble(gpsLat(), d_displayBuff+28, 9);
 		formatDouble(gpsLon(), d_displayBuff+28+9, 10);
@@ -150,14 +351,125 @@ void display(void) {
 		// This call require a total of:
 		// 28+9+10=47 Bytes;
 	} else {
-		snprintf(d_displayBuff, OUTPUT_BUFFER_SIZE,
-			"0x%02X%02X %8lu %4lu %2u %1u %1c NA NA",
-			ge, oe, cc, cf, siv, fix, hdop);
+		snprintf_P(d_displayBuff, OUTPUT_BUFFER_SIZE,
+			PSTR("0x%02X%02X %8lu %4lu %2u %1u %1c NA NA"),
+			ge, oe, mon.count, mon.freq, mon.siv, mon.fix, mon.hdop);
 	}
 	
 	Serial_printLine(d_displayBuff);
+}
+
+//----- Event records queue
+void eventPush(derkgps_event_class_t event_class, uint8_t event) {
+	derkgps_event_rec_t *rec;
 	
-	d_displayLastUpdate = millis();
+	if (d_eventCount == EVENT_QUEUE_SIZE) {
+		// Overwriting the oldest record
+		d_eventHead = (d_eventHead+1) % EVENT_QUEUE_SIZE;
+		d_eventCount--;
+		d_eventOverflow++;
+	}
+	rec = &d_eventQueue[(d_eventHead+d_eventCount) % EVENT_QUEUE_SIZE];
+	d_eventCount++;
+	
+	rec->eclass = event_class;
+	rec->event = event;
+	rec->time = millis();
+	rec->pcount = odoPulseCount();
+	rec->freq = d_freq;
+	rec->speed = (uint16_t)(gpsSpeed()*100);
+	if (gpsIsPosValid()) {
+		rec->lat = (long)(gpsLat()*1000000);
+		rec->lon = (long)(gpsLon()*1000000);
+	} else {
+		rec->lat = 0x7FFFFFFF;
+		rec->lon = 0x7FFFFFFF;
+	}
+}
+
+uint8_t eventPop(derkgps_event_rec_t *rec) {
+	
+	if (!d_eventCount)
+		return 0;
+	
+	*rec = d_eventQueue[d_eventHead];
+	d_eventHead = (d_eventHead+1) % EVENT_QUEUE_SIZE;
+	d_eventCount--;
+	return 1;
+}
+
+uint8_t eventCount(void) {
+	return d_eventCount;
+}
+
+//----- Interrupt line control
+void intrAssert(void) {
+	
+	pinMode(intReq, OUTPUT);
+	d_intrAsserted = 1;
+	d_intrDeferred = 0;
+	d_intrAssertTime = millis();
+	d_intrEverAsserted = 1;
+	d_intrStats.asserted++;
+}
+
+void intrRelease(uint8_t expired) {
+	
+	if (!d_intrAsserted)
+		return;
+	
+	pinMode(intReq, INPUT);
+	d_intrAsserted = 0;
+	d_intrReleaseTime = millis();
+	if (expired)
+		d_intrStats.expired++;
+}
+
+/// @return not-null if the interrupt line could be asserted now
+uint8_t intrAllowed(void) {
+	unsigned long now = millis();
+	
+	if ( d_intrEverAsserted &&
+			(now - d_intrAssertTime) < d_intrHoldoff )
+		return 0;
+	if ( d_intrEverAsserted &&
+			(now - d_intrReleaseTime) < d_intrGap )
+		return 0;
+	return 1;
+}
+
+/// Assert the interrupt line, or coalesce the request with the pending one
+void intrRequest(void) {
+	
+	if ( d_intrAsserted || d_intrDeferred ) {
+		d_intrStats.coalesced++;
+		return;
+	}
+	if ( !intrAllowed() ) {
+		d_intrDeferred = 1;
+		return;
+	}
+	intrAssert();
+}
+
+/// Send deferred interrupts and release expired ones
+void intrUpdate(void) {
+	
+	if ( d_intrDeferred && !d_intrAsserted && intrAllowed() ) {
+		intrAssert();
+	}
+	
+	// Releasing interrupt line after a safe timeout period
+	if ( d_intrAsserted && d_intrTimeout>0 &&
+		(millis() - d_intrAssertTime) >= d_intrTimeout ) {
+		// NOTE these interrupts are loose!... if we are not
+		//	able to read them within the timeout: than it should
+		//	be safer to remove them and go ahead; their records are
+		//	still queued
+		d_pendingEvents[EVENT_CLASS_ODO] = EVENT_NONE;
+		d_pendingEvents[EVENT_CLASS_GPS] = EVENT_NONE;
+		intrRelease(1);
+	}
 }
 
 //----- Alarms control
@@ -176,170 +488,36 @@ void notifyEvent(derkgps_event_class_t event_class, uint8_t event) {
 	
 	// saving event
 	d_pendingEvents[event_class] |= (unsigned char)event;
+	eventPush(event_class, event);
 	
 	// looking if it has to be notified
 	if (intrEnabled && !alreadyNotified) {
-		pinMode(intReq, OUTPUT);
-/* Wait until the interrupt has been read
-		delay(DERKGPS_INTR_LEN);
-		pinMode(intReq, INPUT);
-*/
-		if ( d_intrTimeout>0 ) {
-			d_intrResetTime  = millis();
-			d_intrResetTime += d_intrTimeout;
-		}
-
-
+		intrRequest();
 	}
 	
 }
 
-// NOTE this method should avoid notification storms.
-// Once an event has been notified it should not be notified anymore while
-// it still olds... only at the time of reverse event the notifier should be
-// re-enabled.
 #define SET_EVENT(_evt_)			\
 	event = (0x1 << _evt_)
 void checkAlarms(void) {
-	unsigned long newFreq;
-	unsigned newFix;
 	uint8_t event = 0;
+	uint8_t n;
 	
-	// Checking ODO Moving Events...
-	newFreq = d_freq;
-	if ( d_oldFreq==0 ) {
-		if ( newFreq>0 ) {
-			// START Moving Event
-			SET_EVENT(ODO_EVENT_MOVE);
-			notifyEvent(EVENT_CLASS_ODO, event);
-			digitalWrite(led3, HIGH);
-		}
-	} else if ( newFreq==0 ) {
-		if ( d_oldFreq>0 ) {
-			// STOP Moving Event
-			SET_EVENT(ODO_EVENT_STOP);
-			notifyEvent(EVENT_CLASS_ODO, event);
-			digitalWrite(led3, LOW);
-		}
-	}
-	d_oldFreq = newFreq;
+	// Checking threshold rules: moving, speed, breaking and fix events
+	checkRules();
 	
-/*
-	// Checking GPS Moving Events...
-	if ( gpsSpeed() > MIN_MOVE_SPEED ) {
-		// START Moving Event
-		SET_EVENT(GPS_EVENT_MOVE);
-		notifyEvent(EVENT_CLASS_GPS, event);
+	// Movement led control
+	if (d_freq) {
 		digitalWrite(led3, HIGH);
 	} else {
-		// STOP Moving Event
-		SET_EVENT(GPS_EVENT_STOP);
-		notifyEvent(EVENT_CLASS_GPS, event);
 		digitalWrite(led3, LOW);
 	}
-*/
-	// Checking for EVENT_EMERGENCY_BREAK event
-	// NOTE Acceleration is always OK
-	if ( d_minEmergencyBreak ) {
-		
-		SET_EVENT(ODO_EVENT_EMERGENCY_BREAK);
-		
-		if ( d_df < 0 ) { // Decelleration: monitoring rate
-			d_df = -d_df*1000;
-			if ( (d_df/d_dt) > d_minEmergencyBreak &&
-				!( d_suspendedEvents[EVENT_CLASS_ODO] & (unsigned char)event ) ) {
-				
-				// Trigger an interrupt
-				notifyEvent(EVENT_CLASS_ODO, event);
-				
-				// NOTE this code SUPPOSE that we can't modify d_activeEvents
-				//	using AT Commands... otherwise we must pay attention
-				//	when disabling an event because we don't know anymore if
-				//	the user has required it to be disabled or not.
-				// Now that the event has been notified we suspend it until
-				// we return within the speed limit
-				d_suspendedEvents[EVENT_CLASS_ODO] |= (unsigned char)event;
-			}
-			
-		} else { // Acceleration reenable the event notify
-			d_suspendedEvents[EVENT_CLASS_ODO] &= (unsigned char)~event;
-		}
-	}
-
-	// Checking for EVENT_OVER_SPEED event
-	if ( d_minOverSpeed ) {
-		
-		if ( d_freq > d_minOverSpeed) { // Overspeed: event notify
-			
-			// Over-speed reenable the SAFE_SPEED event notify
-			SET_EVENT(ODO_EVENT_SAFE_SPEED);
-			d_suspendedEvents[EVENT_CLASS_ODO] &= (unsigned char)~event;
-			
-			SET_EVENT(ODO_EVENT_OVER_SPEED);
-			if ( !(d_suspendedEvents[EVENT_CLASS_ODO] & (unsigned char)event) ) {
-				// Trigger an interrupt
-				notifyEvent(EVENT_CLASS_ODO, event);
-				
-				// NOTE this code SUPPOSE that we can't modify d_activeEvents
-				//	using AT Commands... otherwise we must pay attention
-				//	when disabling an event because we don't know anymore if
-				//	the user has required it to be disabled or not.
-				// Now that the event has been notified we suspend it until
-				// we return within the speed limit
-				d_suspendedEvents[EVENT_CLASS_ODO] |= (unsigned char)event;
-			}
-			
-		} else {
-			
-			// Safe speed reenable the OVER_SPEED event notify
-			SET_EVENT(ODO_EVENT_OVER_SPEED);
-			d_suspendedEvents[EVENT_CLASS_ODO] &= (unsigned char)~event;
-			
-			SET_EVENT(ODO_EVENT_SAFE_SPEED);
-			if ( !(d_suspendedEvents[EVENT_CLASS_ODO] & (unsigned char)event) ) {
-				// Trigger an interrupt
-				notifyEvent(EVENT_CLASS_ODO, event);
-				
-				// NOTE this code SUPPOSE that we can't modify d_activeEvents
-				//	using AT Commands... otherwise we must pay attention
-				//	when disabling an event because we don't know anymore if
-				//	the user has required it to be disabled or not.
-				// Now that the event has been notified we suspend it until
-				// we return within the speed limit
-				d_suspendedEvents[EVENT_CLASS_ODO] |= (unsigned char)event;
-			}
-		}
-		
-		// Checking GPS OverSpeed Events...
-		
-	}
-	
-	// Checking GPS fix
-	newFix = gpsFix();
-	if (newFix != d_oldFix) {
-		if ( newFix>0 ) {
-			SET_EVENT(GPS_EVENT_FIX_GET);
-		} else {
-			SET_EVENT(GPS_EVENT_FIX_LOSE);
-		}
-		notifyEvent(EVENT_CLASS_GPS, event);
-		d_oldFix = newFix;
-	}
 
-/*
-	// Checking ODO distance interrupt
-	if ( d_distIntrPCount>0 &&
-		d_pcount>d_distIntrNext ) {
+	// Checking ODO distance events, fired by Timer3 compare match
+	for (n = odoDistanceEvents(); n; n--) {
 		SET_EVENT(ODO_EVENT_DISTANCE);
 		notifyEvent(EVENT_CLASS_ODO, event);
-		d_distIntrNext  = d_pcount;
-		d_distIntrNext += d_distIntrPCount;
-// 		snprintf(d_displayBuff, OUTPUT_BUFFER_SIZE,
-// 			"Next PCount Intr @ %8lu",
-// 			d_distIntrNext);
-// 		Serial_printLine(d_displayBuff);
 	}
-*/
 
 	// Event led control
 	if (d_pendingEvents[EVENT_CLASS_ODO] ||
@@ -348,36 +526,51 @@ void checkAlarms(void) {
 	} else {
 		digitalWrite(led2, LOW);
 	}
-	
-	// Releasing interrupt line after a safe timeout period
-	if ( d_intrTimeout>0 &&
-		d_intrResetTime < millis() ) {
-		// NOTE these interrupts are loose!... if we are not
-		//	able to read them within the timeout: than it should
-		//	be safer to remove them and go ahead
-		d_pendingEvents[EVENT_CLASS_ODO] = EVENT_NONE;
-		d_pendingEvents[EVENT_CLASS_GPS] = EVENT_NONE;
-		pinMode(intReq, INPUT);
-	}
 
 }
 
+// The period method is used below ODO_PERIOD_ENTER and up to
+// ODO_PERIOD_LEAVE [mHz]
+#define ODO_PERIOD_ENTER	16000
+#define ODO_PERIOD_LEAVE	24000
+/// Longer periods are considered a stop [ticks]
+#define ODO_PERIOD_TIMEOUT	(2000UL*TIME_TICKS_PER_MS)
+/// A pulse per tick [mHz]
+#define ODO_TICKS_MHZ		(1000000UL*TIME_TICKS_PER_MS)
+/// Max pulses count within a window computed at full precision
+#define ODO_COUNT_MAX		4000
+/// Shortest update window, bounding the derivative noise [ms]
+#define ODO_WINDOW_MIN		64
+/// Max frequency variation computed at full precision [mHz]
+#define ODO_RATE_MAX		2000000L
+/// Each window weights 1/ODO_RATE_WEIGHT on the filtered derivatives
+#define ODO_RATE_WEIGHT		4
+
 /// @return 0 on successfull data update
 int odoUpdate(void) {
 	unsigned long t1 = 0;
 	unsigned long c1 = 0;
 	unsigned long dc = 0;
+	unsigned long pdt;
+	unsigned long pts;
+	unsigned long elapsed;
+	uint16_t pdc;
+	long dfm;
+	long rate;
 	
 	t1 = millis();
 	c1 = odoPulseCount();
 	
-	// 511[ms] = 0x1FF
-	if ( (t1-d_odoLastUpdate)>>9 ) {
-		d_odoLastUpdate = t1;
-	} else {
-		// Less the 511 ms since last update
+	// The window closes after d_odoWindowPulses or d_odoWindowTime,
+	// thus it is shorter at high speed, where the braking reaction time
+	// matters most, and longer at low speed, where few pulses are noisy
+	elapsed = t1-d_odoLastUpdate;
+	if ( elapsed < ODO_WINDOW_MIN ||
+			(elapsed < d_odoWindowTime &&
+			 (c1-c0) < d_odoWindowPulses) ) {
 		return -1;
 	}
+	d_odoLastUpdate = t1;
 	
 	// NOTE millis() return the number of milliseconds since the current
 	// program started running, as an unsigned long.
@@ -393,17 +586,62 @@ int odoUpdate(void) {
 	// NOTE d_freq = dc/d_dt=dc/((t1-t0)/1000) => dc*1000/(t1-t0)
 	// this last formula is safer using unsigned long values due to truncation
 	//	of decimal digits ;-)
-	if ( c1 == c0 ) {
-		d_freq = 0;
+	d_dt = (t1 - t0);			// Elapsed time in [ms]
+	dc = (c1 - c0);				// Pulses count variation
+	if ( dc < ODO_COUNT_MAX ) {
+		d_freqMilli = (dc*1000000UL)/d_dt;
 	} else {
-		dc = (c1 - c0) * 1000;		// Pulses count variation
-		d_dt = (t1 - t0);		// Elapsed time in [s]
-		d_freq = (dc/d_dt);		// New frequency
+		d_freqMilli = ((dc*1000UL)/d_dt)*1000UL;
 	}
-	d_df = d_freq - f0;			// Frequency variation
+	
+	// At low speed the pulses period gives a finer estimate
+	if ( d_odoPeriodMode && odoPeriod(&pdt, &pdc, &pts) ) {
+		// No edge since longer than the last period: the current
+		// one is at least that long
+		elapsed = timeTicks()-pts;
+		if ( elapsed > pdt ) {
+			pdt = elapsed;
+			pdc = 1;
+		}
+		if ( pdt > ODO_PERIOD_TIMEOUT ) {
+			d_freqMilli = 0;
+		} else {
+			// NOTE ODO_TICKS_MHZ*pdc could overflow
+			d_freqMilli = (ODO_TICKS_MHZ/pdt)*pdc +
+				((ODO_TICKS_MHZ%pdt)*pdc)/pdt;
+		}
+	}
+	d_freq = d_freqMilli/1000;		// New frequency
+	
+	// Switching method by speed, with hysteresis
+	if ( !d_odoPeriodMode && d_freqMilli < ODO_PERIOD_ENTER ) {
+		d_odoPeriodMode = 1;
+		odoSetPeriodMode(1);
+	} else if ( d_odoPeriodMode && d_freqMilli > ODO_PERIOD_LEAVE ) {
+		d_odoPeriodMode = 0;
+		odoSetPeriodMode(0);
+	}
+	
+	// Frequency derivative and acceleration, on fixed point and
+	// filtered by an exponential average
+	dfm = (long)(d_freqMilli - f0);		// Frequency variation [mHz]
+	if ( labs(dfm) < ODO_RATE_MAX ) {
+		rate = (dfm*1000L)/(long)d_dt;
+	} else {
+		rate = (dfm/(long)d_dt)*1000L;
+	}
+	d_freqRate += (rate - d_freqRate)/ODO_RATE_WEIGHT;
+	if ( d_ppk ) {
+		// [mHz/s]*1000/[pulses/km] = [mm/s^2]
+		rate = (d_freqRate/(long)d_ppk)*1000L +
+			((d_freqRate%(long)d_ppk)*1000L)/(long)d_ppk;
+	} else {
+		rate = 0;
+	}
+	d_accel = rate;
 
 	// Saving values for next cycle
-	f0 = d_freq;
+	f0 = d_freqMilli;
 	t0 = t1;
 	c0 = c1;
 	
@@ -411,6 +649,127 @@ int odoUpdate(void) {
 	
 }
 
+//----- Odometer calibration
+// The pulses per km factor is learned by correlating pulses with the GPS
+// distance travelled along straight segments, driven at a minimum speed
+// with a good fix: the distance of each segment is the sum of the
+// distances between its GPS epochs.
+#define CAL_MAX_HDOP	2.0
+#define CAL_MIN_SPEED	15.0		// [km/h]
+#define CAL_MAX_TURN	5.0		// [deg]
+#define CAL_SEGMENT	500.0		// [m]
+/// Each new segment weights 1/CAL_WEIGHT on the pulses per km
+#define CAL_WEIGHT	8
+/// The factor is saved once it changes by more than 1/CAL_SAVE_DIFF
+#define CAL_SAVE_DIFF	200
+#define EARTH_RADIUS	6371000.0	// [m]
+#define DEG_TO_RAD	(M_PI/180.0)
+
+/// The GPS time of the last epoch
+unsigned long d_calUtc = 0;
+/// Not-null while a segment is being measured
+uint8_t d_calActive = 0;
+/// The segment start track degree [deg]
+double d_calDeg;
+/// The last epoch position [deg]
+double d_calLat, d_calLon;
+/// The segment length so far [m]
+double d_calMeters;
+/// The segment start pulses count
+unsigned long d_calCount;
+
+void odoSavePpk(void) {
+	eeprom_write_dword(&eePpk, d_ppk);
+}
+
+void odoLoadPpk(void) {
+	d_ppk = eeprom_read_dword(&eePpk);
+	// A blank EEPROM reads as 0xFF
+	if (d_ppk == 0xFFFFFFFF)
+		d_ppk = 0;
+}
+
+/// Update the pulses per km factor at each new GPS epoch
+void odoCalibrate(void) {
+	unsigned long count;
+	unsigned long saved;
+	double lat, lon;
+	double dx, dy;
+	double turn;
+	long sample;
+	
+	if (gpsTime() == d_calUtc)
+		return;
+	d_calUtc = gpsTime();
+	count = odoPulseCount();
+	
+	if ( !gpsIsPosValid() || gpsFix() < FIX_2D ||
+			gpsHdop() > CAL_MAX_HDOP ||
+			gpsSpeed() < CAL_MIN_SPEED ) {
+		d_calActive = 0;
+		return;
+	}
+	
+	lat = gpsLat();
+	lon = gpsLon();
+	turn = fabs(gpsDegree() - d_calDeg);
+	if (turn > 180.0)
+		turn = 360.0 - turn;
+	
+	if ( !d_calActive || turn > CAL_MAX_TURN ) {
+		// Starting a new segment
+		d_calActive = 1;
+		d_calDeg = gpsDegree();
+		d_calLat = lat;
+		d_calLon = lon;
+		d_calMeters = 0;
+		d_calCount = count;
+		return;
+	}
+	
+	// Equirectangular approximation, fine for the short distances
+	// between two epochs
+	dy = (lat - d_calLat) * DEG_TO_RAD * EARTH_RADIUS;
+	dx = (lon - d_calLon) * DEG_TO_RAD * EARTH_RADIUS * cos(lat*DEG_TO_RAD);
+	d_calMeters += sqrt(dx*dx + dy*dy);
+	d_calLat = lat;
+	d_calLon = lon;
+	
+	if (d_calMeters < CAL_SEGMENT)
+		return;
+	
+	sample = (long)((count - d_calCount)*1000.0/d_calMeters);
+	if ( !d_ppk ) {
+		d_ppk = sample;
+	} else {
+		d_ppk += (sample - (long)d_ppk)/CAL_WEIGHT;
+	}
+	
+	// Next segment starts here
+	d_calMeters = 0;
+	d_calCount = count;
+	
+	// Bounding EEPROM writes: only significant changes are saved
+	saved = eeprom_read_dword(&eePpk);
+	if ( saved == 0xFFFFFFFF ||
+			labs((long)(d_ppk - saved)) > (long)(saved/CAL_SAVE_DIFF) ) {
+		odoSavePpk();
+	}
+}
+
+/// Set the total pulse count, and save it into the log
+void odoSetTotal(unsigned long count) {
+	
+	odoSetPulseCount(count);
+	
+	// Restarting measures across the jump
+	c0 = count;
+	d_calActive = 0;
+	
+	odoLogSave();
+	
+}
+
 void gpsUpdate(void) {
 
 	if (d_gpsPowerState == 0) {
@@ -431,8 +790,15 @@ void gpsUpdate(void) {
 	// 	delay for a speed update...
 	if ( checkInterrupt(UART_GPS) ) {
 		digitalSwitch(led1);
+		PROFILE_BEGIN(PROF_GPS);
 		gpsParse();
+		PROFILE_END(PROF_GPS);
+		odoCalibrate();
 		ackInterrupt(UART_GPS);
+		// Keep the top-halve scheduled while sentences are still queued
+		if ( availableLines(UART_GPS) ) {
+			scheduleTopHalve(UART_GPS);
+		}
 	}
 
 	if ( d_gpsNextCmd ) {
@@ -443,6 +809,100 @@ void gpsUpdate(void) {
 }
 
 //----- System Initialization
+//----- Tasks
+/// The alarms task, released by each odometer update
+int8_t d_taskAlarms = -1;
+
+void odoTask(void) {
+	int result;
+	
+	PROFILE_BEGIN(PROF_ODO);
+	result = odoUpdate();
+	PROFILE_END(PROF_ODO);
+	
+	if ( result == 0 ) {
+		schedPost(d_taskAlarms);
+	}
+	
+}
+
+void alarmsTask(void) {
+	
+	PROFILE_BEGIN(PROF_ALARMS);
+	checkAlarms();
+	PROFILE_END(PROF_ALARMS);
+	
+}
+
+void displayTask(void) {
+	
+	if (d_displayTime) {
+		PROFILE_BEGIN(PROF_DISPLAY);
+		display();
+		PROFILE_END(PROF_DISPLAY);
+	}
+	
+}
+
+void cmdTask(void) {
+	
+	PROFILE_BEGIN(PROF_CMD);
+	parseCommand();
+	PROFILE_END(PROF_CMD);
+	ackInterrupt(UART_AT);
+	// Keep the top-halve scheduled while commands are still queued
+	if ( availableLines(UART_AT) ) {
+		scheduleTopHalve(UART_AT);
+	}
+	
+}
+
+/// Sleep until the next interrupt, unless an event task is pending
+void idleTask(void) {
+	
+	// NOTE only the idle mode keeps running the I/O clock, needed by the
+	// UARTs, the CAN controller and the odometer external clock on timer 3
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	cli();
+	if ( !schedPending() ) {
+		sleep_enable();
+		// NOTE the instruction following sei() is always executed before
+		// any pending interrupt: a post could not be lost before sleeping
+		sei();
+		sleep_cpu();
+		sleep_disable();
+	}
+	sei();
+	
+}
+
+/// Setup the scheduler tasks: function, period [ms], deadline [ms], trigger
+void initTasks(void) {
+	
+	// GPS sentences, power state and commands
+	schedAdd(gpsUpdate,	100,	100,	&uart_intr[UART_GPS]);
+	// Deferred and expired interrupts
+	schedAdd(intrUpdate,	10,	10,	0);
+	// Subscribed registers
+	schedAdd(cmdStream,	10,	50,	0);
+	// Total pulse count persistence
+	schedAdd(odoLogUpdate,	500,	0,	0);
+#ifndef TEST_GPS
+	// Odometer window, triggering alarms checks
+	schedAdd(odoTask,	16,	16,	0);
+	d_taskAlarms = schedAdd(alarmsTask, 0, 10, 0);
+	// Summary sentences
+	schedAdd(displayTask,	100,	0,	0);
+#endif
+	// User commands
+	schedAdd(cmdTask,	0,	20,	&uart_intr[UART_AT]);
+	
+	// Sleeping while there is nothing to do; the timer 1 match wakes up
+	// the CPU at least every ms to release periodic tasks
+	schedIdle(idleTask);
+	
+}
+
 void setup(void) {
 
 	// Disable interrupts (just in case)
@@ -456,8 +916,15 @@ void setup(void) {
 	// Configure timers
 	initTime();
 	
-	// Configure odometer
+	// Configure odometer, restoring the total pulse count
 	initOdo();
+	initOdoLog();
+	
+	// Load alarm rules
+	initRules();
+	
+	// Load odometer calibration
+	odoLoadPpk();
 	
 	// Configure UART ports
 	initSerials();
@@ -522,35 +989,16 @@ void setup(void) {
 	// Initial data update
 	odoUpdate();
 	
+	initTasks();
+	
 	// Enable interrupts
 	sei();
 	
 }
 
 inline void loop(void) {
-	 
-	// Updating GPS data
-	gpsUpdate();
 	
-#ifndef TEST_GPS
-	// Updating ODO data
-	if ( odoUpdate() != 0 ) {
-		return;
-	}
-	
-	// Check constraints and issue alarms
-	checkAlarms();
-	
-	// Display summary sentence
-	if (d_displayTime) {
-		display();
-	}
-#endif
-	// Execute user commands
-	if ( checkInterrupt(UART_AT) ) {
-		parseCommand();
-		ackInterrupt(UART_AT);
-	}
+	schedRun();
 	
 }
 
@@ -559,7 +1007,7 @@ int main(void) {
 	setup();
 	
 	if (d_displayTime) {
-	    Serial_printLine("DerkGPS v2.0 by Patrick Bellasi <derkling@gmail.com>");
+	    Serial_printLine_P(PSTR("DerkGPS v2.0 by Patrick Bellasi <derkling@gmail.com>"));
 	}
 
 	while(1) {
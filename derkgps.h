@@ -31,6 +31,7 @@
 #include "gps.h"
 #include "odo.h"
 #include "can.h"
+#include "rules.h"
 
 // Uncomment to enable GPS sentence testing...
 // #define TEST_GPS
@@ -50,6 +51,7 @@ typedef enum {
 	ODO_EVENT_EMERGENCY_BREAK,
 	ODO_EVENT_SAFE_SPEED,
 	ODO_EVENT_DISTANCE,
+	ODO_EVENT_TOT	// This must be the last entry
 } derkgps_event_odo_t;
 
 typedef enum {
@@ -57,6 +59,7 @@ typedef enum {
 	GPS_EVENT_FIX_LOSE,
 	GPS_EVENT_MOVE,
 	GPS_EVENT_STOP,
+	GPS_EVENT_TOT	// This must be the last entry
 } derkgps_event_gps_t;
 
 /// Event mask defining the events enabled to generate signals
@@ -70,11 +73,48 @@ typedef enum {
 	EVENT_CLASS_TOT	// This must be the last entry
 } derkgps_event_class_t;
 
+/// Host interrupt line statistics
+typedef struct {
+	uint16_t asserted;	///< Interrupts sent
+	uint16_t coalesced;	///< Requests merged into a pending interrupt
+	uint16_t expired;	///< Interrupts released by timeout, not ACKed
+} derkgps_intr_stats_t;
+
+/// Release the host interrupt line
+/// @param expired not-null if the line is released by timeout
+void intrRelease(uint8_t expired);
+
+/// An event occurrence
+typedef struct {
+	uint8_t eclass;		///< derkgps_event_class_t
+	uint8_t event;		///< Event mask
+	unsigned long time;	///< [ms]
+	unsigned long pcount;	///< [pulses]
+	unsigned long freq;	///< [Hz]
+	uint16_t speed;		///< GPS speed [10 m/h]
+	long lat;		///< [10^-6 deg], 0x7FFFFFFF if not valid
+	long lon;		///< [10^-6 deg], 0x7FFFFFFF if not valid
+} derkgps_event_rec_t;
+
+/// The binary size of an event record [bytes]
+#define EVENT_REC_SIZE		24
+
+/// Max number of queued event records, older ones are overwritten
+#define EVENT_QUEUE_SIZE	16
+
+/// Get the oldest queued event record
+/// @return 0 if the queue is empty
+uint8_t eventPop(derkgps_event_rec_t *rec);
+/// @return the number of queued event records
+uint8_t eventCount(void);
+
 
 // AT Control
 #define Serial_print(C)			print(UART_AT, C)
 #define Serial_printStr(STR)		printStr(UART_AT, STR)
 #define Serial_printLine(STR)		printLine(UART_AT, STR)
+#define Serial_printStr_P(STR)		printStr_P(UART_AT, STR)
+#define Serial_printLine_P(STR)		printLine_P(UART_AT, STR)
 #define Serial_printFlush()		flush(UART_AT)
 #define Serial_readLine(BUFF, LEN)	readLine(UART_AT, BUFF, LEN)
 #define SERIAL_NEWLINE	"\r\n"
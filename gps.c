@@ -6,14 +6,12 @@
 #include "gps.h"
 #include <math.h>
 
-# define GpsRead()	read(UART_GPS)
-# define GpsAvailable()	available(UART_GPS)
 
 #ifdef TEST_GPS
 # define GpsDebugChr(CHR)	print(UART_AT, CHR)
 # define GpsDebugStr(STR)	printStr(UART_AT, STR)
-# define GpsDebugToken(STR)	printStr(UART_AT, STR); printStr(UART_AT, " ")
-# define GpsDebugNewLine()	printLine(UART_AT, "")
+# define GpsDebugToken(STR)	printStr(UART_AT, STR); printStr_P(UART_AT, PSTR(" "))
+# define GpsDebugNewLine()	printLine_P(UART_AT, PSTR(""))
 # define GpsDebugDumpNMEA()			\
 	do {					\
 		byte = gpsReadSerial();		\
@@ -31,7 +29,7 @@
 //-----[ GPS Specific Protocol Commands ]---------------------------------------
 
 struct gps_cmd {
-	char *cmd;
+	PGM_P cmd;
 	uint8_t size;
 };
 
@@ -86,13 +84,17 @@ short varEst = 1;
 //--- Parsing vars
 char byte;
 char buff[16];
+/// The sentence being parsed, still sitting into the UART buffer
+uart_line_t gpsLine;
+/// Next char to parse within gpsLine
+uint8_t gpsPos;
 
 //--- GPS Binary Command Support
-char gps_cmd_cold_start[] = {0xb5,0x62,0x06,0x04,0x04,0x00,0xff,0x07,0x02,0x00,0x16,0x79};
-char gps_cmd_hot_start[] = {0xb5,0x62,0x06,0x04,0x04,0x00,0x00,0x00,0x02,0x00,0x10,0x68};
-char gps_cmd_warm_start[] = {0xb5,0x62,0x06,0x04,0x04,0x00,0x01,0x00,0x02,0x00,0x11,0x6c};
+const char gps_cmd_cold_start[] PROGMEM = {0xb5,0x62,0x06,0x04,0x04,0x00,0xff,0x07,0x02,0x00,0x16,0x79};
+const char gps_cmd_hot_start[] PROGMEM = {0xb5,0x62,0x06,0x04,0x04,0x00,0x00,0x00,0x02,0x00,0x10,0x68};
+const char gps_cmd_warm_start[] PROGMEM = {0xb5,0x62,0x06,0x04,0x04,0x00,0x01,0x00,0x02,0x00,0x11,0x6c};
 
-struct gps_cmd cmds[] = {
+const struct gps_cmd cmds[] PROGMEM = {
 	GPS_CMD(gps_cmd_cold_start),
 	GPS_CMD(gps_cmd_hot_start),
 	GPS_CMD(gps_cmd_warm_start),
@@ -109,15 +111,16 @@ void initGps(unsigned long mask) {
 }
 
 //----- Local utility methods
-char gpsReadSerial(void) {
+/// Get the next char of the sentence being parsed.
+/// Once the sentence has been consumed, LINE_TERMINATOR is returned.
+inline char gpsReadSerial(void) {
 	char byte;
 	
-	// Waiting for a char being available...
-	while ( !GpsAvailable() )
-		;
-
-	// Read the incoming byte
-	byte = GpsRead();
+	if ( gpsPos >= gpsLine.len )
+		return LINE_TERMINATOR;
+	
+	byte = lineChar(&gpsLine, gpsPos);
+	gpsPos++;
 	
 	// Echoing readed char (if TEST_GPS defined)
 	GpsDebugChr(byte);
@@ -133,14 +136,14 @@ inline short gpsSentenceEnabled(gpsSentence_t type) {
 void gpsNextToken(char n) {
 	do { do {
 		byte = gpsReadSerial();
-	} while (byte!=',');
-	} while (--n);
+	} while (byte!=',' && byte!=LINE_TERMINATOR);
+	} while (--n && byte!=LINE_TERMINATOR);
 }
 
 void gpsGetToken(char *buf) {
 	
 	byte = gpsReadSerial();
-	while ( (byte != ',') && (byte != '*') ) {
+	while ( (byte != ',') && (byte != '*') && (byte != LINE_TERMINATOR) ) {
 		*buf = byte; buf++;
 		byte = gpsReadSerial();
 	};
@@ -161,14 +164,17 @@ double minToDec(double nmea) {
 
 //----- GPS Binary Command support
 int gpsSendCmd(uint8_t index) {
+	struct gps_cmd cmd;
 	uint8_t i;
 
 	if ( index >= GPS_CMD_COUNT ) {
 		return -1;
 	}
 
-	for (i=0; i<cmds[index].size; i++) {
-		print(UART_GPS, cmds[index].cmd[i]);
+	// Both the table and the commands are stored into flash
+	memcpy_P(&cmd, &cmds[index], sizeof(cmd));
+	for (i=0; i<cmd.size; i++) {
+		print(UART_GPS, pgm_read_byte(cmd.cmd+i));
 	}
 
 	return 0;
@@ -253,6 +259,8 @@ inline gpsSentence_t gpsParseType(void) {
 	// Get to next sentence start '$'
 	do {
 		byte = gpsReadSerial();
+		if ( byte == LINE_TERMINATOR )
+			return GPS_UNK;
 	} while ( byte != '$' );
 	
 	// Eat-up two unneeded 'GP' bytes
@@ -440,6 +448,11 @@ void gpsReset(void) {
 void gpsParse(void) {
 	gpsSentence_t type;
 // 	unsigned char chksum = 0;
+	
+	// Only complete sentences are parsed
+	if ( !lookLine(UART_GPS, &gpsLine) )
+		return;
+	gpsPos = 0;
 		
 	// Ckecking if the pending sentence is of interest
 	type = gpsParseType();
@@ -470,10 +483,8 @@ void gpsParse(void) {
 	
 // 	GpsDebugNewLine();
 	
-	// Consuming input buffer until we reach the CR char
-	do {
-		byte = gpsReadSerial();
-	} while ( byte != 0x0D );
+	// Releasing the whole sentence (up to the CR char)
+	releaseLine(UART_GPS);
 	
 }
 
@@ -586,7 +597,7 @@ unsigned gpsRMC(char *buff, uint8_t size) {
 	unsigned len;
 	
 	//RMC,hhmmss.ss,A,llll.ll,a,yyyyy.yy,a,x.x,x.x,xxxx,x.x,a,m,*hh<CR><LF>
-	len = snprintf(buff, size, "%lu,%c,%f,%c,%f,%c,%f,%f,%lu,%f,%c",
+	len = snprintf_P(buff, size, PSTR("%lu,%c,%f,%c,%f,%c,%f,%f,%lu,%f,%c"),
 			utc,				// UTC Time
 			validity ? 'A' : 'V',		// Status, V=Navigation receiver warning A=Valid
    			(lat>0) ? lat : -lat,		// Latitude
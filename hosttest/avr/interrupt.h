@@ -0,0 +1,13 @@
+/*
+  hosttest/avr/interrupt.h - Host stub of the interrupts support
+*/
+
+#ifndef HostTest_interrupt_h
+#define HostTest_interrupt_h
+
+#define SIGNAL(vector)	void vector(void)
+
+#define cli()		(SREG &= ~0x80)
+#define sei()		(SREG |= 0x80)
+
+#endif
@@ -0,0 +1,49 @@
+/*
+  hosttest/avr/io.h - Host stub of the AT90CAN128 registers
+
+  Only the registers used by the host tests are provided. Counter and
+  flag registers are accessed through functions of the test, which
+  advance the simulated hardware at each access.
+*/
+
+#ifndef HostTest_io_h
+#define HostTest_io_h
+
+#include <stdint.h>
+
+#define _BV(bit)		(1 << (bit))
+#define _SFR_BYTE(sfr)		(sfr)
+
+extern volatile uint8_t SREG;
+
+// Timer 1
+volatile uint16_t *hwTcnt1(void);
+volatile uint8_t *hwTifr1(void);
+#define TCNT1	(*hwTcnt1())
+#define TIFR1	(*hwTifr1())
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+extern volatile uint16_t OCR1A, ICR1;
+
+// Timer 3
+volatile uint16_t *hwTcnt3(void);
+volatile uint8_t *hwTifr3(void);
+#define TCNT3	(*hwTcnt3())
+#define TIFR3	(*hwTifr3())
+extern volatile uint8_t TCCR3A, TCCR3B, TIMSK3;
+extern volatile uint16_t OCR3A, OCR3B;
+
+enum {
+	// TCCR1A, TCCR1B
+	COM1A1 = 7, COM1A0 = 6, WGM11 = 1, WGM10 = 0,
+	ICNC1 = 7, ICES1 = 6, WGM13 = 4, WGM12 = 3,
+	CS12 = 2, CS11 = 1, CS10 = 0,
+	// TIMSK1, TIFR1
+	ICIE1 = 5, OCIE1A = 1, TOIE1 = 0, OCF1A = 1, TOV1 = 0,
+	// TCCR3A, TCCR3B
+	COM3A1 = 7, COM3A0 = 6, COM3B1 = 5, COM3B0 = 4, WGM31 = 1, WGM30 = 0,
+	WGM33 = 4, WGM32 = 3, CS32 = 2, CS31 = 1, CS30 = 0,
+	// TIMSK3, TIFR3
+	OCIE3B = 2, OCIE3A = 1, TOIE3 = 0, OCF3B = 2, OCF3A = 1, TOV3 = 0,
+};
+
+#endif
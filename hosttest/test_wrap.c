@@ -0,0 +1,252 @@
+/*
+  hosttest/test_wrap.c - Host stress test of the counter snapshots
+
+  Copyright (c) 2008-2009 Patrick Bellasi
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General
+  Public License along with this library; if not, write to the
+  Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+  Boston, MA  02111-1307  USA
+
+*/
+
+// Timer 1 and counter 3 are simulated: both advance by a random step on
+// each access to their TCNT or TIFR registers, so a wrap can happen
+// between any two reads of a snapshot, and the overflow and compare match
+// ISRs run only after a random number of samples, as if delayed by other
+// ISRs. The snapshots must always be exact and monotonic, and no distance
+// event could be lost.
+//
+// Build and run from the project directory with: make hosttest
+
+#include <stdio.h>
+#include "at90can.h"
+#include "odo.h"
+
+// Pulses or ticks counted at most on each register access
+#define HW_STEP_MAX	7
+// Samples an ISR could be delayed by: the delay must stay within half
+// of the timer 1 period, i.e. the ticks counted on 6 accesses per sample
+#define HW_DELAY_MAX	8
+#define SAMPLES		2000000UL
+// Pulses between two distance events: more than the pulses counted
+// while SIG_OUTPUT_COMPARE3A accounts an event
+#define DIST_STEP	32
+// Pulses a distance event could be accounted late by, i.e. counted
+// within the ISR delay
+#define DIST_LAG	(2*HW_DELAY_MAX*6*HW_STEP_MAX)
+
+extern volatile unsigned long timer1_overflow_count;
+extern volatile unsigned long timer3_overflow_count;
+void initTime(void);
+void SIG_OUTPUT_COMPARE1A(void);
+void SIG_OVERFLOW3(void);
+void SIG_OUTPUT_COMPARE3A(void);
+
+volatile uint8_t SREG;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t OCR1A, ICR1;
+volatile uint8_t TCCR3A, TCCR3B, TIMSK3;
+volatile uint16_t OCR3A, OCR3B;
+
+// The simulated hardware: real pulses and ticks, and the registers
+static unsigned long hw_pulses = 0;
+static unsigned long hw_ticks = 0;
+static volatile uint16_t hw_tcnt1 = 0;
+static volatile uint8_t hw_tifr1 = 0;
+static volatile uint16_t hw_tcnt3 = 0;
+static volatile uint8_t hw_tifr3 = 0;
+
+// Once frozen the hardware does not count anymore
+static uint8_t hw_frozen = 0;
+
+// Samples taken with a pending, not yet accounted, wrap
+static unsigned long hw_races1 = 0;
+static unsigned long hw_races3 = 0;
+
+static unsigned long hw_seed = 1;
+
+static unsigned hwRand(unsigned n) {
+	hw_seed = hw_seed * 1103515245UL + 12345UL;
+	return (unsigned)((hw_seed >> 16) & 0x7FFF) % n;
+}
+
+static void hwAdvance(void) {
+	unsigned step;
+	
+	if ( hw_frozen )
+		return;
+	
+	// Compare match on the pulse reaching OCR3A
+	step = hwRand(HW_STEP_MAX+1);
+	if ( (uint16_t)(OCR3A - hw_tcnt3 - 1) < step )
+		hw_tifr3 |= _BV(OCF3A);
+	hw_pulses += step;
+	if ( (uint16_t)hw_pulses < hw_tcnt3 )
+		hw_tifr3 |= _BV(TOV3);
+	hw_tcnt3 = (uint16_t)hw_pulses;
+	
+	// CTC mode: cleared on the match with OCR1A
+	step = hwRand(HW_STEP_MAX+1);
+	hw_ticks += step;
+	hw_tcnt1 += step;
+	if ( hw_tcnt1 > OCR1A ) {
+		hw_tcnt1 -= OCR1A+1;
+		hw_tifr1 |= _BV(OCF1A);
+	}
+}
+
+volatile uint16_t *hwTcnt1(void) {
+	hwAdvance();
+	return &hw_tcnt1;
+}
+
+volatile uint8_t *hwTifr1(void) {
+	if ( hw_tifr1 & _BV(OCF1A) )
+		hw_races1++;
+	hwAdvance();
+	return &hw_tifr1;
+}
+
+volatile uint16_t *hwTcnt3(void) {
+	hwAdvance();
+	return &hw_tcnt3;
+}
+
+volatile uint8_t *hwTifr3(void) {
+	if ( hw_tifr3 & _BV(TOV3) )
+		hw_races3++;
+	hwAdvance();
+	return &hw_tifr3;
+}
+
+// Run the pending ISRs once their random delay has expired
+static void hwService(void) {
+	static uint8_t delay1 = 0;
+	static uint8_t delay3 = 0;
+	static uint8_t delay3a = 0;
+	
+	if ( !(SREG & 0x80) )
+		return;
+	
+	if ( hw_tifr1 & _BV(OCF1A) ) {
+		if ( !delay1 )
+			delay1 = 1 + hwRand(HW_DELAY_MAX);
+		if ( !--delay1 ) {
+			hw_tifr1 &= ~_BV(OCF1A);
+			SIG_OUTPUT_COMPARE1A();
+		}
+	}
+	if ( hw_tifr3 & _BV(TOV3) ) {
+		if ( !delay3 )
+			delay3 = 1 + hwRand(HW_DELAY_MAX);
+		if ( !--delay3 ) {
+			hw_tifr3 &= ~_BV(TOV3);
+			SIG_OVERFLOW3();
+		}
+	}
+	if ( (hw_tifr3 & _BV(OCF3A)) && (TIMSK3 & _BV(OCIE3A)) ) {
+		if ( !delay3a )
+			delay3a = 1 + hwRand(HW_DELAY_MAX);
+		if ( !--delay3a ) {
+			hw_tifr3 &= ~_BV(OCF3A);
+			SIG_OUTPUT_COMPARE3A();
+		}
+	}
+}
+
+#define CHECK(cond, i, what, val) \
+	if ( !(cond) ) { \
+		printf("FAIL sample %lu: %s %lu\n", (i), (what), (unsigned long)(val)); \
+		return 1; \
+	}
+
+int main(void) {
+	unsigned long i;
+	unsigned long before, after;
+	unsigned long count, ticks, us, ms;
+	unsigned long count_prev = 0, ticks_prev = 0, us_prev = 0, ms_prev = 0;
+	unsigned long dist_start, dist_events = 0;
+	
+	SREG = 0;
+	initTime();
+	initOdo();
+	sei();
+	// Events are counted from an exact start
+	hw_frozen = 1;
+	dist_start = odoPulseCount();
+	odoSetDistance(DIST_STEP);
+	hw_frozen = 0;
+	
+	for (i = 0; i < SAMPLES; i++) {
+		
+		before = hw_pulses;
+		count = odoPulseCount();
+		after = hw_pulses;
+		CHECK(count >= before && count <= after, i, "pulse count", count);
+		CHECK(count >= count_prev, i, "pulse count back from", count_prev);
+		count_prev = count;
+		
+		dist_events += odoDistanceEvents();
+		CHECK(dist_events <= (count - dist_start)/DIST_STEP, i,
+				"distance events ahead", dist_events);
+		CHECK(count - dist_start < DIST_LAG ||
+				dist_events >= (count - dist_start - DIST_LAG)/DIST_STEP,
+				i, "distance events lost", dist_events);
+		
+		before = hw_ticks;
+		ticks = timeTicks();
+		after = hw_ticks;
+		CHECK(ticks >= before && ticks <= after, i, "ticks", ticks);
+		CHECK(ticks >= ticks_prev, i, "ticks back from", ticks_prev);
+		ticks_prev = ticks;
+		
+		before = hw_ticks;
+		us = micros();
+		after = hw_ticks;
+		CHECK(us >= before && us <= after, i, "micros", us);
+		CHECK(us >= us_prev, i, "micros back from", us_prev);
+		us_prev = us;
+		
+		// millis() just reads the ISR count: it lags a delayed ISR
+		after = hw_ticks;
+		ms = millis();
+		CHECK(ms <= after/TIME_TICKS_PER_MS && ms+1 >= after/TIME_TICKS_PER_MS,
+				i, "millis", ms);
+		CHECK(ms >= ms_prev, i, "millis back from", ms_prev);
+		ms_prev = ms;
+		
+		hwService();
+	}
+	
+	// Accounting the events of the pulses counted so far
+	hw_frozen = 1;
+	for (i = 0; i < HW_DELAY_MAX; i++)
+		hwService();
+	dist_events += odoDistanceEvents();
+	CHECK(dist_events == (hw_pulses - dist_start)/DIST_STEP, i,
+			"distance events", dist_events);
+	
+	printf("%lu samples, %lu pulses (%lu wraps), %lu ms, %lu events\n",
+			SAMPLES, hw_pulses, hw_pulses >> 16,
+			hw_ticks/TIME_TICKS_PER_MS, dist_events);
+	printf("samples with a pending wrap: counter 3 %lu, timer 1 %lu\n",
+			hw_races3, hw_races1);
+	if ( !hw_races1 || !hw_races3 ) {
+		printf("FAIL no race injected\n");
+		return 1;
+	}
+	printf("PASS\n");
+	
+	return 0;
+}
@@ -21,15 +21,169 @@ Boston, MA  02111-1307  USA
 */
 
 #include "at90can.h"
+#include "profile.h"
 
 // The number of times counter 3 has overflowed since the program started.
 // Must be volatile or gcc will optimize away some uses of it.
 volatile unsigned long timer3_overflow_count = 0;
 
+// The pulse count of next distance event, and the pulses between two events
+// (0 if disabled).
+volatile unsigned long odo_dist_next = 0;
+volatile unsigned odo_dist_step = 0;
+// Distance events fired but not yet read by odoDistanceEvents()
+volatile uint8_t odo_dist_pending = 0;
+
+// Period mode: timer 1 ticks and pulse count at the last edge, ticks and
+// pulses between the last two edges, and number of edges seen (up to 2)
+volatile unsigned long odo_edge_ts = 0;
+volatile unsigned long odo_edge_count = 0;
+volatile unsigned long odo_edge_dt = 0;
+volatile uint16_t odo_edge_dc = 0;
+volatile uint8_t odo_edge_valid = 0;
+
+// The pulse count, folding in a pending overflow not yet accounted by
+// SIG_OVERFLOW3, e.g. within higher priority ISRs.
+// NOTE This function MUST be called with interrupt disabled
+static unsigned long odoCount(void) {
+    unsigned long count;
+    uint16_t tcnt;
+    
+    tcnt = TCNT3;
+    count = timer3_overflow_count;
+    // If the overflow flag is set, tcnt could have been read before or
+    // after the wrap: only a small value has been read after it
+    if ( (TIFR3 & _BV(TOV3)) && tcnt < 0x8000 )
+        count += 0x10000;
+    return count + tcnt;
+    
+}
+
 unsigned long odoPulseCount(void) {
+    unsigned long count;
+    uint8_t sreg;
+    
+    // NOTE reading both the overflow count and TCNT3 with interrupts
+    // enabled, a wrap in between would make the count jump back by 64K
+    sreg = SREG;
+    cli();
+    count = odoCount();
+    SREG = sreg;
+    
+    return count;
+    
+}
+
+// Account all the passed distance events and set the compare match on the
+// low word of the next one: the high word is checked on each match.
+// NOTE This function MUST be called with interrupt disabled
+static void odoDistanceArm(void) {
+    
+    do {
+        while ( (long)(odoCount() - odo_dist_next) >= 0 ) {
+            if ( odo_dist_pending < 0xFF )
+                odo_dist_pending++;
+            odo_dist_next += odo_dist_step;
+        }
+        OCR3A = (uint16_t)odo_dist_next;
+        // The pulse of the event could have been counted before OCR3A
+        // has been written: it would not match until next wrap
+    } while ( (long)(odoCount() - odo_dist_next) >= 0 );
+    
+}
+
+void odoSetPulseCount(unsigned long count) {
+    uint8_t sreg;
+    
+    sreg = SREG;
+    cli();
+    
+    TCNT3 = (uint16_t)count;
+    timer3_overflow_count = count & 0xFFFF0000UL;
+    // Discarding a pending overflow of the old count
+    TIFR3 = _BV(TOV3);
+    
+    // Compare matches are relative to the count
+    if ( odo_dist_step ) {
+        odo_dist_next = count + odo_dist_step;
+        odo_dist_pending = 0;
+        odoDistanceArm();
+    }
+    if ( TIMSK3 & _BV(OCIE3B) ) {
+        odo_edge_valid = 0;
+        OCR3B = (uint16_t)(count + 1);
+    }
+    
+    SREG = sreg;
+}
+
+void odoSetDistance(unsigned pulses) {
+    uint8_t sreg;
+    
+    sreg = SREG;
+    cli();
     
-    return (timer3_overflow_count + TCNT3);
+    odo_dist_step = pulses;
+    odo_dist_pending = 0;
+    if ( pulses ) {
+        odo_dist_next = odoCount() + pulses;
+        // Discarding an old match before arming the new one, which could
+        // match as soon as OCR3A is written
+        TIFR3 = _BV(OCF3A);
+        odoDistanceArm();
+        sbi(TIMSK3, OCIE3A);
+    } else {
+        cbi(TIMSK3, OCIE3A);
+    }
     
+    SREG = sreg;
+}
+
+void odoSetPeriodMode(uint8_t enable) {
+    uint8_t sreg;
+    
+    sreg = SREG;
+    cli();
+    
+    odo_edge_valid = 0;
+    if ( enable ) {
+        // Matching on next pulse
+        OCR3B = (uint16_t)(odoCount() + 1);
+        TIFR3 = _BV(OCF3B);
+        sbi(TIMSK3, OCIE3B);
+    } else {
+        cbi(TIMSK3, OCIE3B);
+    }
+    
+    SREG = sreg;
+}
+
+uint8_t odoPeriod(unsigned long *dt, uint16_t *dc, unsigned long *ts) {
+    uint8_t valid;
+    uint8_t sreg;
+    
+    sreg = SREG;
+    cli();
+    valid = (odo_edge_valid >= 2);
+    *dt = odo_edge_dt;
+    *dc = odo_edge_dc;
+    *ts = odo_edge_ts;
+    SREG = sreg;
+    
+    return valid;
+}
+
+uint8_t odoDistanceEvents(void) {
+    uint8_t events;
+    uint8_t sreg;
+    
+    sreg = SREG;
+    cli();
+    events = odo_dist_pending;
+    odo_dist_pending = 0;
+    SREG = sreg;
+    
+    return events;
 }
 
 
@@ -52,6 +206,13 @@ void initOdo(void) {
     cbi(TCCR3A, WGM31);
     cbi(TCCR3A, WGM30);
     
+    // Output Compare A is used for distance events, Output Compare B for
+    // period measurement: OC3A (PE3) and OC3B (PE4) pins are disconnected
+    cbi(TCCR3A, COM3A1);
+    cbi(TCCR3A, COM3A0);
+    cbi(TCCR3A, COM3B1);
+    cbi(TCCR3A, COM3B0);
+    
     // Enable timer 3 overflow interrupt
     sbi(TIMSK3, TOIE3);
     
@@ -65,3 +226,41 @@ SIGNAL(SIG_OVERFLOW3) {
     timer3_overflow_count += 0x10000;
        
 }
+
+// Output Compare Match Interrupt A: distance events
+SIGNAL(SIG_OUTPUT_COMPARE3A) {
+    PROFILE_BEGIN(PROF_ISR_ODO_DIST);
+    
+    // Only the low word has matched: the event could be 64K pulses ahead
+    if ( (long)(odoCount() - odo_dist_next) >= 0 )
+        odoDistanceArm();
+    
+    PROFILE_END(PROF_ISR_ODO_DIST);
+}
+
+// Output Compare Match Interrupt B: period measurement
+SIGNAL(SIG_OUTPUT_COMPARE3B) {
+    unsigned long count;
+    unsigned long ts;
+    
+    // NOTE taken first: its error is just the latency of this ISR
+    ts = timeTicks();
+    PROFILE_BEGIN(PROF_ISR_ODO_EDGE);
+    count = odoCount();
+    
+    if ( odo_edge_valid ) {
+        odo_edge_dt = ts - odo_edge_ts;
+        // NOTE more than one pulse could have been counted if an edge
+        // has been missed
+        odo_edge_dc = count - odo_edge_count;
+        odo_edge_valid = 2;
+    } else {
+        odo_edge_valid = 1;
+    }
+    odo_edge_ts = ts;
+    odo_edge_count = count;
+    
+    OCR3B = (uint16_t)(count + 1);
+    
+    PROFILE_END(PROF_ISR_ODO_EDGE);
+}
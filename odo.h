@@ -25,5 +25,28 @@
 
 void initOdo(void);
 unsigned long odoPulseCount(void);
+/// Set the pulse count, e.g. to restore the total one at boot
+void odoSetPulseCount(unsigned long count);
+
+/// Generate a distance event every PULSES pulses, 0 to disable them.
+/// Events are triggered by the Timer3 compare match on the exact pulse.
+void odoSetDistance(unsigned pulses);
+/// @return the distance events fired since last call
+uint8_t odoDistanceEvents(void);
+
+/// Enable the timestamping of each pulse edge, by the Timer3 compare match
+/// on the next pulse and timer 1 ticks
+/// NOTE the timestamp is read by the compare match ISR: it is late by the
+///	interrupt latency, i.e. the longest ISR, or interrupts disabled
+///	section, running at the edge. No ISR formats or prints on the UARTs,
+///	thus the latency is bound to tens of us (see the +QPF ISR stages):
+///	on the 41ms of a 24Hz period, the fastest one, 100us are 0.25%.
+void odoSetPeriodMode(uint8_t enable);
+/// Get the period between the last two timestamped edges
+/// @param dt timer 1 ticks between the edges
+/// @param dc pulses between the edges
+/// @param ts timer 1 ticks at the last edge
+/// @return 0 if two edges have not yet been timestamped
+uint8_t odoPeriod(unsigned long *dt, uint16_t *dc, unsigned long *ts);
 
 #endif
@@ -0,0 +1,131 @@
+/*
+odolog.c
+
+Copyright (c) 2008-2009 Patrick Bellasi
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General
+Public License along with this library; if not, write to the
+Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+Boston, MA  02111-1307  USA
+
+*/
+
+#include <stddef.h>
+#include <avr/eeprom.h>
+
+#include "odolog.h"
+#include "odo.h"
+
+/// Odometer pulses per km defined within derkgps.c
+extern unsigned long d_ppk;
+
+/// The log
+derkgps_odolog_rec_t EEMEM eeOdoLog[ODOLOG_RECORDS];
+/// Resets by brown-out, saved into EEPROM
+uint16_t EEMEM eeBrownouts;
+
+/// The slot of the last record
+uint8_t d_odoLogIdx = ODOLOG_RECORDS-1;
+/// The sequence number of the last record
+unsigned long d_odoLogSeq = 0;
+/// The pulse count of the last record
+unsigned long d_odoLogPulses = 0;
+/// Resets by brown-out
+uint16_t d_brownouts = 0;
+
+static uint8_t odoLogSum(derkgps_odolog_rec_t *rec) {
+	uint8_t *p = (uint8_t*)rec;
+	uint8_t sum = 0xA5;
+	uint8_t i;
+	
+	for (i=0; i<offsetof(derkgps_odolog_rec_t, sum); i++)
+		sum += p[i];
+	return sum;
+}
+
+void initOdoLog(void) {
+	derkgps_odolog_rec_t rec;
+	uint8_t i;
+	
+	// NOTE the AT90CAN brown-out detector has no interrupt: it just holds
+	// the MCU in reset, thus the pulses counted since the last record (at
+	// most ODOLOG_METERS) are lost. Brown-outs are counted at next boot.
+	d_brownouts = eeprom_read_word(&eeBrownouts);
+	if (d_brownouts == 0xFFFF)
+		d_brownouts = 0;
+	// NOTE BORF could be set by the supply rising at power-on too: only
+	// resets without PORF are brown-outs. All the flags are cleared, so
+	// that next reset reports only its own cause.
+	if ( (MCUSR & _BV(BORF)) && !(MCUSR & _BV(PORF)) ) {
+		d_brownouts++;
+		eeprom_write_word(&eeBrownouts, d_brownouts);
+	}
+	MCUSR = 0;
+	
+	d_odoLogIdx = ODOLOG_RECORDS-1;
+	d_odoLogSeq = 0;
+	d_odoLogPulses = 0;
+	
+	// Looking for the most recent valid record; blank or torn ones (e.g.
+	// by a reset while writing) are skipped
+	for (i=0; i<ODOLOG_RECORDS; i++) {
+		eeprom_read_block(&rec, &eeOdoLog[i], sizeof(rec));
+		if ( rec.seq == 0xFFFFFFFF || rec.sum != odoLogSum(&rec) )
+			continue;
+		if ( rec.seq < d_odoLogSeq )
+			continue;
+		d_odoLogIdx = i;
+		d_odoLogSeq = rec.seq;
+		d_odoLogPulses = rec.pulses;
+	}
+	
+	odoSetPulseCount(d_odoLogPulses);
+	
+}
+
+void odoLogSave(void) {
+	derkgps_odolog_rec_t rec;
+	
+	d_odoLogIdx = (d_odoLogIdx+1) % ODOLOG_RECORDS;
+	d_odoLogSeq++;
+	d_odoLogPulses = odoPulseCount();
+	
+	rec.seq = d_odoLogSeq;
+	rec.pulses = d_odoLogPulses;
+	rec.sum = odoLogSum(&rec);
+	eeprom_write_block(&rec, &eeOdoLog[d_odoLogIdx], sizeof(rec));
+	
+}
+
+void odoLogUpdate(void) {
+	unsigned long step;
+	
+	// NOTE writes are bounded by distance: with 100k cycles per EEPROM
+	// cell, ODOLOG_RECORDS records every ODOLOG_METERS last 640.000 km
+	if ( d_ppk ) {
+		step = (d_ppk*ODOLOG_METERS)/1000;
+	} else {
+		step = ODOLOG_PULSES;
+	}
+	if ( step == 0 )
+		step = 1;
+	
+	if ( (odoPulseCount() - d_odoLogPulses) < step )
+		return;
+	odoLogSave();
+	
+}
+
+unsigned long odoLogSeq(void) {
+	return d_odoLogSeq;
+}
@@ -0,0 +1,57 @@
+/*
+  odolog.h
+
+  Copyright (c) 2008-2009 Patrick Bellasi
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General
+  Public License along with this library; if not, write to the
+  Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+  Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef OdoLog_h
+#define OdoLog_h
+
+#include "derkgps.h"
+
+//----- Odometer log
+// The total pulse count is persisted into an EEPROM log of rotating
+// records, each one tagged by an increasing sequence number: the valid
+// record with the highest sequence is the most recent one, and each write
+// goes to the next slot, spreading the wear over the whole log.
+typedef struct derkgps_odolog_rec {
+	uint32_t seq;		///< Sequence number, 0xFFFFFFFF if blank
+	uint32_t pulses;	///< Total pulse count
+	uint8_t sum;		///< Checksum of the previous fields
+} derkgps_odolog_rec_t;
+
+/// Records within the log
+#define ODOLOG_RECORDS		64
+/// Distance between two records [m]
+#define ODOLOG_METERS		100
+/// Pulses between two records while not yet calibrated
+#define ODOLOG_PULSES		1000
+
+/// Restore the total pulse count from the log, to be called once at setup
+void initOdoLog(void);
+/// Append a record if at least ODOLOG_METERS have been driven since the
+/// last one
+void odoLogUpdate(void);
+/// Append a record of the current total pulse count
+void odoLogSave(void);
+/// @return the sequence number of the last record
+unsigned long odoLogSeq(void);
+
+#endif
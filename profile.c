@@ -0,0 +1,71 @@
+/*
+profile.c
+
+Copyright (c) 2008-2009 Patrick Bellasi
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General
+Public License along with this library; if not, write to the
+Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+Boston, MA  02111-1307  USA
+
+*/
+
+#include <string.h>
+
+#include "profile.h"
+
+#ifdef PROFILE
+
+/// The stages statistics
+profile_stats_t d_profile[PROF_STAGES];
+
+void profileAdd(profile_stage_t stage, unsigned long ticks) {
+	profile_stats_t *stats = &d_profile[stage];
+	uint8_t sreg;
+	
+	if (ticks > 0xFFFF)
+		ticks = 0xFFFF;
+	
+	sreg = SREG;
+	cli();
+	if ( stats->count < 0xFFFF ) {
+		stats->count++;
+		stats->total += ticks;
+	}
+	if ( stats->count == 1 || ticks < stats->min )
+		stats->min = ticks;
+	if ( ticks > stats->max )
+		stats->max = ticks;
+	SREG = sreg;
+}
+
+void profileGet(profile_stage_t stage, profile_stats_t *stats) {
+	uint8_t sreg;
+	
+	// NOTE ISRs statistics are updated asynchronously
+	sreg = SREG;
+	cli();
+	memcpy(stats, &d_profile[stage], sizeof(profile_stats_t));
+	SREG = sreg;
+}
+
+void profileReset(void) {
+	uint8_t sreg;
+	
+	sreg = SREG;
+	cli();
+	memset(d_profile, 0, sizeof(d_profile));
+	SREG = sreg;
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*
+  profile.h
+
+  Copyright (c) 2008-2009 Patrick Bellasi
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General
+  Public License along with this library; if not, write to the
+  Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+  Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef Profile_h
+#define Profile_h
+
+#include "at90can.h"
+
+// Uncomment to enable the hot-path profiler...
+// #define PROFILE
+
+//----- Profiler
+// Stages and ISRs are timed by the timer 1 ticks (timeTicks()) at their
+// entry and exit; min, average and max are reported in CPU cycles.
+// NOTE main loop stages include the time spent by preempting ISRs.
+typedef enum {
+	PROF_GPS = 0,		///< gpsParse()
+	PROF_ODO,		///< odoUpdate()
+	PROF_ALARMS,		///< checkAlarms()
+	PROF_DISPLAY,		///< display()
+	PROF_CMD,		///< parseCommand()
+	PROF_ISR_UART0_RX,
+	PROF_ISR_UART1_RX,
+	PROF_ISR_UART0_TX,
+	PROF_ISR_UART1_TX,
+	PROF_ISR_CAN,
+	PROF_ISR_ODO_DIST,	///< Timer 3 compare match A
+	PROF_ISR_ODO_EDGE,	///< Timer 3 compare match B
+	PROF_STAGES		// This must be the last entry
+} profile_stage_t;
+
+typedef struct {
+	uint16_t count;		///< Timed runs
+	uint16_t min;		///< [ticks]
+	uint16_t max;		///< [ticks]
+	unsigned long total;	///< [ticks]
+} profile_stats_t;
+
+#ifdef PROFILE
+
+# define PROFILE_BEGIN(STAGE)						\
+	unsigned long __prof_##STAGE = timeTicks()
+# define PROFILE_END(STAGE)						\
+	profileAdd(STAGE, timeTicks() - __prof_##STAGE)
+
+/// Account a run of STAGE, lasted TICKS
+void profileAdd(profile_stage_t stage, unsigned long ticks);
+/// Get a coherent copy of STAGE statistics
+void profileGet(profile_stage_t stage, profile_stats_t *stats);
+/// Reset all the statistics
+void profileReset(void);
+
+#else
+
+# define PROFILE_BEGIN(STAGE)
+# define PROFILE_END(STAGE)
+
+#endif
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ram.c
+
+Copyright (c) 2008-2009 Patrick Bellasi
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General
+Public License along with this library; if not, write to the
+Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+Boston, MA  02111-1307  USA
+
+*/
+
+#include "ram.h"
+
+/// End of the static variables, defined by the linker
+extern uint8_t _end;
+/// Top of the stack, i.e. RAMEND, defined by the linker
+extern uint8_t __stack;
+
+void ramPaint(void) __attribute__ ((naked, used, section(".init1")));
+
+// NOTE this runs before the C runtime setup: neither the stack pointer nor
+// the zero register are initialized, thus it is plain assembler
+void ramPaint(void) {
+	
+	__asm volatile (
+		"	ldi r30, lo8(_end)	\n"
+		"	ldi r31, hi8(_end)	\n"
+		"	ldi r24, %0		\n"
+		"	ldi r25, hi8(__stack)	\n"
+		"1:	st Z+, r24		\n"
+		"	cpi r30, lo8(__stack)	\n"
+		"	cpc r31, r25		\n"
+		"	brlo 1b			\n"
+		"	breq 1b			\n"
+		: : "i" (RAM_CANARY) );
+	
+}
+
+uint16_t ramUntouched(void) {
+	const uint8_t *p = &_end;
+	
+	// The stack grows downward: untouched bytes are on the bottom
+	while ( p <= &__stack && *p == RAM_CANARY )
+		p++;
+	return p - &_end;
+}
+
+uint16_t ramStackPeak(void) {
+	return (&__stack - &_end + 1) - ramUntouched();
+}
+
+uint16_t ramFree(void) {
+	return (uint8_t*)SP - &_end;
+}
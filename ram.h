@@ -0,0 +1,44 @@
+/*
+  ram.h
+
+  Copyright (c) 2008-2009 Patrick Bellasi
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General
+  Public License along with this library; if not, write to the
+  Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+  Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef Ram_h
+#define Ram_h
+
+#include "at90can.h"
+
+//----- RAM usage
+// At startup the RAM between the end of the static variables and the top
+// of the stack is painted with RAM_CANARY: the deepest stack usage is then
+// where the first byte overwritten by the stack is found. The heap is not
+// used, thus all that RAM is available to the stack.
+#define RAM_CANARY	0xC5
+
+/// @return the RAM never reached by the stack so far [bytes]
+uint16_t ramUntouched(void);
+/// @return the deepest stack usage so far [bytes]
+uint16_t ramStackPeak(void);
+/// @return the RAM currently free between static variables and the stack
+/// [bytes]
+uint16_t ramFree(void);
+
+#endif
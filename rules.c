@@ -0,0 +1,207 @@
+/*
+rules.c
+
+Copyright (c) 2008-2009 Patrick Bellasi
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General
+Public License along with this library; if not, write to the
+Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+Boston, MA  02111-1307  USA
+
+*/
+
+#include <avr/eeprom.h>
+
+#include "rules.h"
+
+/// Odometer values defined within derkgps.c
+extern unsigned long d_freq;
+extern unsigned long d_freqMilli;
+extern long d_freqRate;
+extern long d_accel;
+
+void notifyEvent(derkgps_event_class_t event_class, uint8_t event);
+
+/// The rules table
+derkgps_rule_t d_rules[RULES_MAX];
+
+// Rule state flags
+#define RULE_ACTIVE	0x01	///< The rule has entered
+#define RULE_PENDING	0x02	///< The rule is waiting to switch
+
+/// The rules state
+uint8_t d_rulesState[RULES_MAX];
+/// Time the pending condition has started [ms]
+unsigned long d_rulesSince[RULES_MAX];
+
+/// The rules table saved into EEPROM
+derkgps_rule_t EEMEM eeRules[RULES_MAX];
+
+/// The default rules
+static void defaultRules(void) {
+	
+	memset(d_rules, 0, sizeof(d_rules));
+	
+	d_rules[RULE_MOVE].src = RULE_SRC_MFREQ;
+	d_rules[RULE_MOVE].cmp = RULE_GT;
+	d_rules[RULE_MOVE].enter = RULE_EVENT(EVENT_CLASS_ODO, ODO_EVENT_MOVE);
+	d_rules[RULE_MOVE].leave = RULE_EVENT(EVENT_CLASS_ODO, ODO_EVENT_STOP);
+	
+	// Enabled by setting a threshold
+	d_rules[RULE_SPEED].src = RULE_SRC_FREQ;
+	d_rules[RULE_SPEED].cmp = RULE_OFF;
+	d_rules[RULE_SPEED].enter = RULE_EVENT(EVENT_CLASS_ODO, ODO_EVENT_OVER_SPEED);
+	d_rules[RULE_SPEED].leave = RULE_EVENT(EVENT_CLASS_ODO, ODO_EVENT_SAFE_SPEED);
+	
+	// Enabled by setting a threshold
+	d_rules[RULE_BREAK].src = RULE_SRC_DECEL;
+	d_rules[RULE_BREAK].cmp = RULE_OFF;
+	d_rules[RULE_BREAK].enter = RULE_EVENT(EVENT_CLASS_ODO, ODO_EVENT_EMERGENCY_BREAK);
+	d_rules[RULE_BREAK].leave = RULE_NO_EVENT;
+	
+	d_rules[RULE_FIX].src = RULE_SRC_FIX;
+	d_rules[RULE_FIX].cmp = RULE_GT;
+	d_rules[RULE_FIX].enter = RULE_EVENT(EVENT_CLASS_GPS, GPS_EVENT_FIX_GET);
+	d_rules[RULE_FIX].leave = RULE_EVENT(EVENT_CLASS_GPS, GPS_EVENT_FIX_LOSE);
+	
+}
+
+uint8_t ruleEventValid(unsigned event) {
+	
+	if (event == RULE_NO_EVENT)
+		return 1;
+	
+	// NOTE the class indexes the events masks, and the event is a bit of
+	// an 8 bits mask
+	switch (event>>4) {
+	case EVENT_CLASS_ODO:
+		return (event & 0x0F) < ODO_EVENT_TOT;
+	case EVENT_CLASS_GPS:
+		return (event & 0x0F) < GPS_EVENT_TOT;
+	}
+	return 0;
+}
+
+void initRules(void) {
+	uint8_t i;
+	
+	eeprom_read_block(d_rules, eeRules, sizeof(d_rules));
+	
+	// A blank EEPROM reads as 0xFF, corrupted rules are discarded too
+	for (i=0; i<RULES_MAX; i++) {
+		if (d_rules[i].src >= RULE_SRC_TOT ||
+				d_rules[i].cmp > RULE_LT ||
+				!ruleEventValid(d_rules[i].enter) ||
+				!ruleEventValid(d_rules[i].leave)) {
+			defaultRules();
+			break;
+		}
+	}
+	
+	memset(d_rulesState, 0, sizeof(d_rulesState));
+}
+
+void saveRules(void) {
+	eeprom_write_block(d_rules, eeRules, sizeof(d_rules));
+}
+
+void resetRule(uint8_t idx) {
+	d_rulesState[idx] = 0;
+}
+
+/// @return the current value of a rule source
+static unsigned long ruleValue(uint8_t src) {
+	
+	switch(src) {
+	case RULE_SRC_FREQ:
+		return d_freq;
+	case RULE_SRC_DECEL:
+		// NOTE acceleration is reported as a 0 decelleration
+		if ( d_freqRate >= 0 )
+			return 0;
+		return (unsigned long)(-d_freqRate)/1000;
+	case RULE_SRC_SPEED:
+		return (unsigned long)(gpsSpeed()*100);
+	case RULE_SRC_HDOP:
+		return (unsigned long)(gpsHdop()*100);
+	case RULE_SRC_FIX:
+		return gpsFix();
+	case RULE_SRC_MFREQ:
+		return d_freqMilli;
+	case RULE_SRC_BRAKE:
+		if ( d_accel >= 0 )
+			return 0;
+		return (unsigned long)(-d_accel);
+	}
+	return 0;
+}
+
+/// Notify a rule event
+static void ruleNotify(uint8_t event) {
+	
+	if (event == RULE_NO_EVENT)
+		return;
+	notifyEvent(event>>4, 0x1 << (event & 0x0F));
+}
+
+// NOTE each rule costs a value read and a comparison, while an event is
+// notified only on rule transitions thus avoiding notification storms
+void checkRules(void) {
+	derkgps_rule_t *rule;
+	unsigned long value;
+	unsigned long now;
+	uint8_t toggle;
+	uint8_t i;
+	
+	now = millis();
+	for (i=0; i<RULES_MAX; i++) {
+		rule = &d_rules[i];
+		if (rule->cmp == RULE_OFF)
+			continue;
+		
+		value = ruleValue(rule->src);
+		
+		// Not-null iff the rule should switch state
+		if ( !(d_rulesState[i] & RULE_ACTIVE) ) {
+			if (rule->cmp == RULE_GT)
+				toggle = value > rule->threshold;
+			else
+				toggle = value < rule->threshold;
+		} else {
+			if (rule->cmp == RULE_GT)
+				toggle = value+rule->hysteresis <= rule->threshold;
+			else
+				toggle = value >= rule->threshold+rule->hysteresis;
+		}
+		
+		if (!toggle) {
+			d_rulesState[i] &= ~RULE_PENDING;
+			continue;
+		}
+		
+		// Debouncing
+		if ( !(d_rulesState[i] & RULE_PENDING) ) {
+			d_rulesState[i] |= RULE_PENDING;
+			d_rulesSince[i] = now;
+		}
+		if ( (now - d_rulesSince[i]) < rule->duration )
+			continue;
+		
+		d_rulesState[i] ^= RULE_ACTIVE;
+		d_rulesState[i] &= ~RULE_PENDING;
+		if (d_rulesState[i] & RULE_ACTIVE)
+			ruleNotify(rule->enter);
+		else
+			ruleNotify(rule->leave);
+	}
+}
@@ -0,0 +1,86 @@
+/*
+  rules.h
+
+  Copyright (c) 2008-2009 Patrick Bellasi
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General
+  Public License along with this library; if not, write to the
+  Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+  Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef Rules_h
+#define Rules_h
+
+#include "derkgps.h"
+
+//----- Rule sources
+#define RULE_SRC_FREQ	0	///< Odometer pulses frequency [Hz]
+#define RULE_SRC_DECEL	1	///< Odometer decelleration [Hz/s]
+#define RULE_SRC_SPEED	2	///< GPS ground speed [10 m/h]
+#define RULE_SRC_HDOP	3	///< GPS HDOP [1/100]
+#define RULE_SRC_FIX	4	///< GPS fix value
+#define RULE_SRC_MFREQ	5	///< Odometer pulses frequency [mHz]
+#define RULE_SRC_BRAKE	6	///< Odometer decelleration [mm/s^2]
+#define RULE_SRC_TOT	7	// This must be the last entry
+
+//----- Rule comparisons
+#define RULE_OFF	0	///< Rule disabled
+#define RULE_GT		1	///< Enter if value > threshold
+#define RULE_LT		2	///< Enter if value < threshold
+
+/// Rule events are: (class<<4 | event), no event if RULE_NO_EVENT
+#define RULE_EVENT(CLASS, EVENT)	(((CLASS)<<4) | (EVENT))
+#define RULE_NO_EVENT			0xFF
+
+/// A threshold rule.
+/// A rule enters when its source value crosses the threshold and leaves
+/// once the value is back beyond the threshold by more than the
+/// hysteresis; both transitions are taken only if the new condition holds
+/// for at least the rule duration. The enter or leave events are notified
+/// on each transition.
+typedef struct {
+	uint8_t src;		///< Source signal
+	uint8_t cmp;		///< Comparison
+	uint8_t enter;		///< Event notified when entering
+	uint8_t leave;		///< Event notified when leaving
+	unsigned long threshold;
+	unsigned long hysteresis;
+	uint16_t duration;	///< Min condition duration [ms]
+} derkgps_rule_t;
+
+/// Max number of rules
+#define RULES_MAX	8
+
+// Default rules, which could not be removed
+#define RULE_MOVE	0	///< ODO MOVE/STOP
+#define RULE_SPEED	1	///< ODO OVER_SPEED/SAFE_SPEED
+#define RULE_BREAK	2	///< ODO EMERGENCY_BREAK
+#define RULE_FIX	3	///< GPS FIX_GET/FIX_LOSE
+
+extern derkgps_rule_t d_rules[RULES_MAX];
+
+/// Load rules from EEPROM, or the default ones
+void initRules(void);
+/// Save rules into EEPROM
+void saveRules(void);
+/// Evaluate enabled rules, notifying their events
+void checkRules(void);
+/// Reset a rule state, to be called once it has been changed
+void resetRule(uint8_t idx);
+/// @return not-null if EVENT is RULE_NO_EVENT or a defined class event
+uint8_t ruleEventValid(unsigned event);
+
+#endif
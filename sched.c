@@ -0,0 +1,183 @@
+/*
+sched.c
+
+Copyright (c) 2008-2009 Patrick Bellasi
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General
+Public License along with this library; if not, write to the
+Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+Boston, MA  02111-1307  USA
+
+*/
+
+#include <string.h>
+
+#include "sched.h"
+
+/// The tasks table
+sched_task_t d_tasks[SCHED_TASKS];
+/// Tasks within the table
+uint8_t d_tasksCount = 0;
+/// Tasks released by schedPost(), a bit per task
+volatile uint8_t d_tasksPosted = 0;
+/// The idle function
+sched_fn_t d_schedIdle = 0;
+/// Time spent by the idle function within the current window [us]
+unsigned long d_schedIdleTime = 0;
+/// The current window start [ms]
+unsigned long d_schedWindow = 0;
+/// CPU idle within the last window [1/1000]
+uint16_t d_schedIdleLoad = 0;
+
+int8_t schedAdd(sched_fn_t fn, uint16_t period, uint16_t deadline,
+		volatile uint8_t *trigger) {
+	sched_task_t *task;
+	
+	if (d_tasksCount >= SCHED_TASKS)
+		return -1;
+	
+	task = &d_tasks[d_tasksCount];
+	memset(task, 0, sizeof(sched_task_t));
+	task->fn = fn;
+	task->period = period;
+	task->deadline = deadline ? deadline : SCHED_NO_DEADLINE;
+	task->trigger = trigger;
+	task->next = millis() + period;
+	
+	return d_tasksCount++;
+}
+
+void schedPost(uint8_t id) {
+	uint8_t sreg;
+	
+	sreg = SREG;
+	cli();
+	d_tasksPosted |= _BV(id);
+	SREG = sreg;
+}
+
+void schedIdle(sched_fn_t fn) {
+	d_schedIdle = fn;
+}
+
+void schedResetStats(void) {
+	uint8_t i;
+	
+	for (i=0; i<d_tasksCount; i++) {
+		d_tasks[i].runs = 0;
+		d_tasks[i].misses = 0;
+		d_tasks[i].runtime = 0;
+		d_tasks[i].maxRuntime = 0;
+	}
+}
+
+uint8_t schedPending(void) {
+	uint8_t i;
+	
+	if (d_tasksPosted)
+		return 1;
+	for (i=0; i<d_tasksCount; i++) {
+		if (d_tasks[i].trigger && *d_tasks[i].trigger)
+			return 1;
+	}
+	return 0;
+}
+
+/// Release the tasks which are due
+static void schedRelease(unsigned long now) {
+	sched_task_t *task;
+	uint8_t posted;
+	uint8_t sreg;
+	uint8_t i;
+	
+	sreg = SREG;
+	cli();
+	posted = d_tasksPosted;
+	d_tasksPosted = 0;
+	SREG = sreg;
+	
+	for (i=0; i<d_tasksCount; i++) {
+		task = &d_tasks[i];
+		if (task->ready)
+			continue;
+		if ( (posted & _BV(i)) ||
+				(task->trigger && *task->trigger) ||
+				(task->period && (long)(now - task->next) >= 0) ) {
+			task->ready = 1;
+			task->released = now;
+		}
+	}
+}
+
+void schedRun(void) {
+	sched_task_t *task;
+	unsigned long now;
+	unsigned long start;
+	unsigned long runtime;
+	long left;
+	long minLeft = 0;
+	int8_t id = -1;
+	uint8_t i;
+	
+	now = millis();
+	
+	// NOTE idle [us] over the window [ms] is in [1/1000]
+	if ( (now - d_schedWindow) >= SCHED_IDLE_WINDOW ) {
+		d_schedIdleLoad = d_schedIdleTime/(now - d_schedWindow);
+		d_schedIdleTime = 0;
+		d_schedWindow = now;
+	}
+	
+	schedRelease(now);
+	
+	// Earliest deadline first
+	for (i=0; i<d_tasksCount; i++) {
+		task = &d_tasks[i];
+		if (!task->ready)
+			continue;
+		left = (long)(task->released + task->deadline - now);
+		if (id < 0 || left < minLeft) {
+			id = i;
+			minLeft = left;
+		}
+	}
+	
+	if (id < 0) {
+		if (d_schedIdle) {
+			start = micros();
+			d_schedIdle();
+			d_schedIdleTime += micros() - start;
+		}
+		return;
+	}
+	
+	task = &d_tasks[id];
+	task->ready = 0;
+	if (task->period) {
+		// Next release, skipping the periods already missed
+		task->next += task->period;
+		if ( (long)(now - task->next) >= 0 )
+			task->next = now + task->period;
+	}
+	
+	start = micros();
+	task->fn();
+	runtime = micros() - start;
+	
+	task->runs++;
+	task->runtime += runtime;
+	if (runtime > task->maxRuntime)
+		task->maxRuntime = (runtime < 0xFFFF) ? runtime : 0xFFFF;
+	if ( (long)(millis() - task->released) > (long)task->deadline )
+		task->misses++;
+}
@@ -0,0 +1,79 @@
+/*
+  sched.h
+
+  Copyright (c) 2008-2009 Patrick Bellasi
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General
+  Public License along with this library; if not, write to the
+  Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+  Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef Sched_h
+#define Sched_h
+
+#include "at90can.h"
+
+//----- Scheduler
+// A cooperative run-queue scheduler: each task runs to completion and is
+// released either periodically, or by an event, i.e. a trigger flag set by
+// an ISR (e.g. uart_intr[]) or a schedPost(). Among the released tasks the
+// one with the earliest deadline runs first.
+typedef void (*sched_fn_t)(void);
+
+typedef struct {
+	sched_fn_t fn;
+	uint16_t period;		///< Release period [ms], 0 if none
+	uint16_t deadline;		///< Release to completion [ms], 0 if none
+	volatile uint8_t *trigger;	///< Released while not-null, or 0
+	unsigned long next;		///< Next periodic release [ms]
+	unsigned long released;		///< Last release [ms]
+	uint8_t ready;			///< Not-null once released
+	// Runtime accounting
+	uint16_t runs;			///< Completed runs
+	uint16_t misses;		///< Deadline misses
+	unsigned long runtime;		///< Total runtime [us]
+	uint16_t maxRuntime;		///< Max runtime [us]
+} sched_task_t;
+
+/// Max number of tasks
+#define SCHED_TASKS		8
+/// The deadline of tasks without one [ms]
+#define SCHED_NO_DEADLINE	60000U
+/// The CPU idle measurement window [ms]
+#define SCHED_IDLE_WINDOW	1000
+
+extern sched_task_t d_tasks[SCHED_TASKS];
+extern uint8_t d_tasksCount;
+/// CPU idle within the last window [1/1000]
+extern uint16_t d_schedIdleLoad;
+
+/// Add a task
+/// @return the task ID, or -1 if the tasks table is full
+int8_t schedAdd(sched_fn_t fn, uint16_t period, uint16_t deadline,
+		volatile uint8_t *trigger);
+/// Release an event task, could be called by ISRs
+void schedPost(uint8_t id);
+/// Set the function to call when no task is released
+void schedIdle(sched_fn_t fn);
+/// @return not-null if an event task has been triggered or posted, to be
+/// called with interrupts disabled before sleeping
+uint8_t schedPending(void);
+/// Run the earliest deadline released task, or the idle function
+void schedRun(void);
+/// Reset the runtime accounting
+void schedResetStats(void);
+
+#endif
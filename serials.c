@@ -22,8 +22,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <avr/eeprom.h>
+#include <avr/cpufunc.h>
 
 #include "serials.h"
+#include "profile.h"
 
 // The UART buffers
 unsigned char uart0_buffer[UART0_BUFFER_SIZE];
@@ -39,15 +42,85 @@ static uint8_t lines[UART_NUM];
 static uint8_t bytes[UART_NUM];
 uint8_t uart_intr[UART_NUM];
 
+// Complete lines descriptors, filled by the RX interrupt
+static uint8_t lineStart[UART_NUM][UART_LINES];
+static uint8_t lineLen[UART_NUM][UART_LINES];
+// Descriptor of the oldest queued line
+static uint8_t lineFirst[UART_NUM];
+// Start of the line being received
+static uint8_t lineBegin[UART_NUM];
+// Set while discarding the remainder of an overflowed line
+static uint8_t lineDrop[UART_NUM];
+// Ports supporting binary frames
+static uint8_t frames[UART_NUM] = {UART0_FRAMES, UART1_FRAMES};
+// Bytes still expected to complete the frame being received
+// (FRAME_LEN while waiting for the frame length, 0 when receiving lines)
+static uint8_t frameLeft[UART_NUM];
+#define FRAME_LEN	0xFF
+
+// Receiver statistics
+static uart_stats_t stats[UART_NUM];
+
+// The UART transmit queues
+unsigned char uart0_txbuffer[UART0_TXBUFFER_SIZE];
+unsigned char uart1_txbuffer[UART1_TXBUFFER_SIZE];
+
+static unsigned char *txBuffer[] = {uart0_txbuffer, uart1_txbuffer};
+static uint8_t txSize[UART_NUM] = {UART0_TXBUFFER_SIZE, UART1_TXBUFFER_SIZE};
+
+// txHead is written by print() with interrupts disabled, txTail only by the
+// UDRE interrupt
+static volatile uint8_t txHead[UART_NUM];
+static volatile uint8_t txTail[UART_NUM];
+// Set once a char has been moved into the transmitter
+static uint8_t txSent[UART_NUM];
+
+// The current baud rates
+static unsigned long baud[UART_NUM];
+// The baud rates to restore at boot time
+uint32_t EEMEM eeBaud[UART_NUM];
+
+/// Program the baud rate generator, the transmitter must be idle.
+static int baudApply(uart_port_t port, unsigned long rate) {
+	uint16_t ubrr;
+	uint8_t u2x;
+
+	if (baudSetting(rate, &ubrr, &u2x) < 0)
+		return -1;
+
+	if (port == UART0) {
+		if (u2x)
+			sbi(UCSR0A, U2X0);
+		else
+			cbi(UCSR0A, U2X0);
+		UBRR0H = (uint8_t)(ubrr>>8);
+		UBRR0L = (uint8_t)ubrr;
+	} else {
+		if (u2x)
+			sbi(UCSR1A, U2X1);
+		else
+			cbi(UCSR1A, U2X1);
+		UBRR1H = (uint8_t)(ubrr>>8);
+		UBRR1L = (uint8_t)ubrr;
+	}
+
+	baud[port] = rate;
+	return 0;
+}
+
+/// Restore the saved baud rate, falling back to the default one if
+/// the EEPROM has never been written (or contains garbage)
+static void baudLoad(uart_port_t port, unsigned long rate) {
+	if (baudApply(port, eeprom_read_dword(&eeBaud[port])) < 0)
+		baudApply(port, rate);
+}
+
 // NOTE this function must be called with interrupts disabled
 void initSerials(void) {
     
 //-------- UART0
-	// Single speed operations
-	cbi(UCSR0A, U2X0);
-	// Set baud rate
-	UBRR0H = (uint8_t)(UART_BAUD_CALC(UART0_BAUD_RATE,F_CPU)>>8);
-	UBRR0L = (uint8_t)UART_BAUD_CALC(UART0_BAUD_RATE,F_CPU);
+	// Set baud rate (and single/double speed operations)
+	baudLoad(UART0, UART0_BAUD_RATE);
 	// Asynchronous 8N1
 	cbi(UCSR0C, UMSEL0);
 	cbi(UCSR0C, UPM01);
@@ -66,14 +139,19 @@ void initSerials(void) {
 	tail[UART0] = 0;
 	lines[UART0] = 0;
 	bytes[UART0] = 0;
+	lineFirst[UART0] = 0;
+	lineBegin[UART0] = 0;
+	lineDrop[UART0] = 0;
+	frameLeft[UART0] = 0;
+	memset(&stats[UART0], 0, sizeof(uart_stats_t));
 	uart_intr[UART0] = 0;
+	txHead[UART0] = 0;
+	txTail[UART0] = 0;
+	txSent[UART0] = 0;
 
 //-------- UART1
-	// Single speed operations
-	cbi(UCSR1A, U2X1);
-	// Set baud rate
-	UBRR1H = (uint8_t)(UART_BAUD_CALC(UART1_BAUD_RATE,F_CPU)>>8);
-	UBRR1L = (uint8_t)UART_BAUD_CALC(UART1_BAUD_RATE,F_CPU);
+	// Set baud rate (and single/double speed operations)
+	baudLoad(UART1, UART1_BAUD_RATE);
 	// Asynchronous 8N1
 	cbi(UCSR1C, UMSEL1);
 	cbi(UCSR1C, UPM11);
@@ -92,7 +170,15 @@ void initSerials(void) {
 	tail[UART1] = 0;
 	lines[UART1] = 0;
 	bytes[UART1] = 0;
+	lineFirst[UART1] = 0;
+	lineBegin[UART1] = 0;
+	lineDrop[UART1] = 0;
+	frameLeft[UART1] = 0;
+	memset(&stats[UART1], 0, sizeof(uart_stats_t));
 	uart_intr[UART1] = 0;
+	txHead[UART1] = 0;
+	txTail[UART1] = 0;
+	txSent[UART1] = 0;
 }
 
 uint8_t available(uart_port_t port) {
@@ -110,49 +196,86 @@ char look(uart_port_t port) {
 
 char read(uart_port_t port) {
 	char byte;
+	uint8_t sreg;
 	
 	// if the head isn't ahead of the tail, we don't have any characters
 	if (head[port] == tail[port]) {
 		return -1;
 	} else {
 		byte = buffer[port][tail[port]];
+		
+		sreg = SREG;
+		cli();
+		// Reading into the line being received: keep its start in sync
+		if (lineBegin[port] == tail[port])
+			lineBegin[port] = (tail[port]+1)%size[port];
 		tail[port] = (tail[port]+1)%size[port];
 		
-		if (byte==LINE_TERMINATOR )
+		if (byte==LINE_TERMINATOR ) {
+			lineFirst[port] = (lineFirst[port]+1)%UART_LINES;
 			lines[port]--;
+		}
 		
 		bytes[port]--;
+		SREG = sreg;
 		return byte;
 	}
 }
 
-//NOTE: this method could return a NON 0-terminated buffer if size
-//	is less than the present buffer-line
+uint8_t availableLines(uart_port_t port) {
+	return lines[port];
+}
+
+uint8_t lookLine(uart_port_t port, uart_line_t *line) {
+	
+	if (!lines[port])
+		return 0;
+	
+	line->buff = buffer[port];
+	line->size = size[port];
+	line->start = lineStart[port][lineFirst[port]];
+	line->len = lineLen[port][lineFirst[port]];
+	
+	return 1;
+}
+
+void releaseLine(uart_port_t port) {
+	uint8_t len;
+	uint8_t sreg;
+	
+	if (!lines[port])
+		return;
+	
+	len = lineLen[port][lineFirst[port]];
+	
+	sreg = SREG;
+	cli();
+	tail[port] = (tail[port]+len)%size[port];
+	lineFirst[port] = (lineFirst[port]+1)%UART_LINES;
+	lines[port]--;
+	bytes[port] -= len;
+	SREG = sreg;
+}
+
+//NOTE: this method return a truncated line if len is less than the
+//	present buffer-line, the remainder of the line is discarded anyway
 int readLine(uart_port_t port, char *buff, unsigned short len) {
-	unsigned short i = 0;
+	uart_line_t line;
+	unsigned short i;
 	
-	// if the head isn't ahead of the tail, we don't have any characters
-	// OR
 	// if we have not yet received a LINE_TERMINATOR, we don't have any complete line
-	if (!lines[port]) {
+	if (!lookLine(port, &line)) {
 		buff[0] = 0;
 		return -1;
-	} else {
-		len--; // Reserve space for NULL termiator
-		do {
-			buff[i] = buffer[port][tail[port]];
-			tail[port] = (tail[port]+1)%size[port];
-		} while ( buff[i]!=LINE_TERMINATOR && (++i<len) );
-		
-		// Check if we returned a line
-		if ( i<len ) {
-			// A complete line is in the buffer
-			lines[port]--;
-			// Moving pointer to NULL terminator position
-			i++;
-		}
-		buff[i] = 0; // Adding terminator to buffer
 	}
+	
+	len--; // Reserve space for NULL termiator
+	for (i = 0; i<line.len && i<len; i++)
+		buff[i] = lineChar(&line, i);
+	buff[i] = 0; // Adding terminator to buffer
+	
+	releaseLine(port);
+	
 	return i;
 }
 
@@ -162,76 +285,387 @@ void flush(uart_port_t port) {
 	// the value to rx_buffer_tail; the previous value of rx_buffer_head
 	// may be written to rx_buffer_tail, making it appear as if the buffer
 	// were full, not empty.
+	uint8_t sreg;
+	
+	sreg = SREG;
+	cli();
 	head[port] = tail[port];
 	lines[port] = 0;
+	bytes[port] = 0;
+	lineBegin[port] = tail[port];
+	lineDrop[port] = 0;
+	frameLeft[port] = 0;
+	SREG = sreg;
 }
 
-void print(uart_port_t port, char c) {
-    
+void readStats(uart_port_t port, uart_stats_t *copy) {
+	uint8_t sreg;
+	
+	sreg = SREG;
+	cli();
+	memcpy(copy, &stats[port], sizeof(uart_stats_t));
+	SREG = sreg;
+}
+
+void resetStats(uart_port_t port) {
+	uint8_t sreg;
+	
+	sreg = SREG;
+	cli();
+	memset(&stats[port], 0, sizeof(uart_stats_t));
+	SREG = sreg;
+}
+
+/// Move the next queued char into the transmitter data register.
+/// This must be called only once the data register is empty.
+/// @return 0 if the TX queue was already empty
+inline uint8_t txByte(uart_port_t port) {
+	unsigned char c;
+
+	if (txHead[port] == txTail[port])
+		return 0;
+
+	c = txBuffer[port][txTail[port]];
+	txTail[port] = (txTail[port]+1)%txSize[port];
+
+	// Clearing TXC (by writing it to one) to track when this char has
+	// been shifted out; FE, DOR and UPE must be written to zero.
+	if (port == UART0) {
+		UCSR0A = (UCSR0A & (unsigned char)_BV(U2X0)) | _BV(TXC0);
+		UDR0 = c;
+	} else {
+		UCSR1A = (UCSR1A & (unsigned char)_BV(U2X1)) | _BV(TXC1);
+		UDR1 = c;
+	}
+	txSent[port] = 1;
+
+	return 1;
+}
+
+/// Transmit one queued char by polling, used when interrupts are disabled
+/// (e.g. when printing from within an interrupt handler) and the UDRE
+/// interrupt could not drain the queue.
+static void txPoll(uart_port_t port) {
 	if (port == UART0) {
 		// wait until UDR ready
 		while(!(UCSR0A & (unsigned char)_BV(UDRE0)));
-		// Send character
-		UDR0 = c;
 	} else {
 		// wait until UDR ready
 		while(!(UCSR1A & (unsigned char)_BV(UDRE1)));
-		// Send character
-		UDR1 = c;
 	}
+	txByte(port);
+}
+
+int baudSetting(unsigned long rate, uint16_t *ubrr, uint8_t *u2x) {
+	unsigned long div;
+	unsigned long actual;
+	unsigned long err;
+	unsigned long best = 0xFFFFFFFF;
+	uint8_t speed;
+
+	// NOTE checked before any multiplication, which could otherwise
+	//	wrap for garbage rates (e.g. read from an erased EEPROM)
+	if (!rate || rate > F_CPU/8)
+		return -1;
+
+	// Try single speed (div=16) first: on a tie it has a better noise
+	// immunity, thus double speed (div=8) must be strictly better
+	for (speed=0; speed<2; speed++) {
+		div = speed ? 8 : 16;
+		if ( rate > F_CPU/div )
+			continue;
+		div = UART_BAUD_CALC(rate, F_CPU, div);
+		if ( div > 0x0FFF )
+			continue;
+		actual = F_CPU/((speed ? 8UL : 16UL)*(div+1));
+		err = (actual>rate) ? actual-rate : rate-actual;
+		err = (err*1000)/rate;
+		if (err < best) {
+			best = err;
+			*ubrr = div;
+			*u2x = speed;
+		}
+	}
+
+	if (best > UART_BAUD_MAXERR)
+		return -1;
 
+	return best;
 }
 
-void printStr(uart_port_t port, const char *str) {
-	while (*str)
-		print(port, *str++);
+int setBaudRate(uart_port_t port, unsigned long rate) {
+	uint16_t ubrr;
+	uint8_t u2x;
+	uint8_t sreg;
+
+	if (baudSetting(rate, &ubrr, &u2x) < 0)
+		return -1;
+
+	// Wait for queued chars to be sent...
+	txDrain(port);
+	// ... and for the last one to be shifted out
+	if (txSent[port]) {
+		if (port == UART0)
+			while(!(UCSR0A & (unsigned char)_BV(TXC0)));
+		else
+			while(!(UCSR1A & (unsigned char)_BV(TXC1)));
+	}
+
+	sreg = SREG;
+	cli();
+	baudApply(port, rate);
+	SREG = sreg;
+
+	// Whatever has been received so far is garbage at the new baud rate
+	flush(port);
+
+	return 0;
+}
+
+unsigned long baudRate(uart_port_t port) {
+	return baud[port];
+}
+
+void saveBaudRate(uart_port_t port) {
+	if (eeprom_read_dword(&eeBaud[port]) != baud[port])
+		eeprom_write_dword(&eeBaud[port], baud[port]);
+}
+
+uint8_t txFree(uart_port_t port) {
+	return txSize[port]-1-
+		(txSize[port]+txHead[port]-txTail[port])%txSize[port];
+}
+
+void txDrain(uart_port_t port) {
+	while (txHead[port] != txTail[port]) {
+		if (!tbi(SREG, SREG_I))
+			txPoll(port);
+	}
 }
 
-void printLine(uart_port_t port, const char *str) {
+int print(uart_port_t port, char c) {
+	uint8_t i;
+	uint8_t sreg;
+	int blocked = 0;
+
+	// print() could be called from interrupt handlers too: the slot
+	// must be claimed atomically
+	sreg = SREG;
+	cli();
+	i = (txHead[port]+1)%txSize[port];
+
+	// If the queue is full we have to wait for the UDRE interrupt to
+	// release a slot... or to send a char by ourself if the caller is
+	// running with interrupts disabled.
+	while (i == txTail[port]) {
+		blocked = 1;
+		if (sreg & _BV(SREG_I)) {
+			// NOTE the instruction following sei() is always executed
+			// before any pending interrupt: without the nop a cli()
+			// right after it would never let SIG_UARTx_DATA run
+			sei();
+			_NOP();
+			cli();
+		} else {
+			txPoll(port);
+		}
+		// An interrupt handler could have queued chars meanwhile
+		i = (txHead[port]+1)%txSize[port];
+	}
+
+	txBuffer[port][txHead[port]] = c;
+	txHead[port] = i;
+
+	// (Re)Enable the data register empty interrupt
+	if (port == UART0)
+		sbi(UCSR0B, UDRIE0);
+	else
+		sbi(UCSR1B, UDRIE1);
+
+	SREG = sreg;
+	return blocked;
+}
+
+int printStr(uart_port_t port, const char *str) {
+	int blocked = 0;
+
 	while (*str)
-		print(port, *str++);
-	print(port, '\n');
-	print(port, '\r');
-	
+		blocked |= print(port, *str++);
+
+	return blocked;
+}
+
+int printLine(uart_port_t port, const char *str) {
+	int blocked;
+
+	blocked  = printStr(port, str);
+	blocked |= print(port, '\n');
+	blocked |= print(port, '\r');
+
+	return blocked;
+}
+
+int printStr_P(uart_port_t port, PGM_P str) {
+	int blocked = 0;
+	char c;
+
+	while ( (c = pgm_read_byte(str++)) )
+		blocked |= print(port, c);
+
+	return blocked;
+}
+
+int printLine_P(uart_port_t port, PGM_P str) {
+	int blocked;
+
+	blocked  = printStr_P(port, str);
+	blocked |= print(port, '\n');
+	blocked |= print(port, '\r');
+
+	return blocked;
 }
 
 //----- Interrupt handlers
 
 /// UART bottom-halve interrupt handler
+/// Only complete lines are made visible to consumers: for each received
+/// LINE_TERMINATOR (or binary frame end) a line descriptor is queued, while
+/// a line which does not fit the buffer (or the descriptors queue) is
+/// discarded as a whole.
 inline void rxByte(uart_port_t port, unsigned char c ) {
 	uint8_t i = (head[port]+1)%size[port];
+	uint8_t slot;
+	uint8_t len;
+	uint8_t eol = 0;
+
+	// Eating-up the remainder of an overflowed line (or frame)
+	if (lineDrop[port]) {
+		stats[port].dropped++;
+		if (frameLeft[port] == FRAME_LEN) {
+			frameLeft[port] = (c > UART_FRAME_MAXLEN) ? 0 : c+2;
+			lineDrop[port] = frameLeft[port];
+		} else if (frameLeft[port]) {
+			lineDrop[port] = --frameLeft[port];
+		} else if ( c == LINE_TERMINATOR ) {
+			lineDrop[port] = 0;
+		}
+		return;
+	}
+
+	// Look if we are at end-of-line (or end-of-frame)
+	if (frameLeft[port] == FRAME_LEN) {
+		if (c > UART_FRAME_MAXLEN) {
+			// Not a valid frame: dropping the SYNC
+			stats[port].dropped += 2;
+			bytes[port]--;
+			head[port] = lineBegin[port];
+			frameLeft[port] = 0;
+			return;
+		}
+		// DATA and CRC16 still to come
+		frameLeft[port] = c+2;
+	} else if (frameLeft[port]) {
+		eol = !(--frameLeft[port]);
+	} else {
+		if (frames[port] && head[port] == lineBegin[port]) {
+			// Eating-up the LF of a CR-LF line end
+			if ( c == '\n' )
+				return;
+			if ( c == UART_FRAME_SYNC )
+				frameLeft[port] = FRAME_LEN;
+		}
+		eol = ( c == LINE_TERMINATOR );
+	}
 
 	// if we should be storing the received character into the location
 	// just before the tail (meaning that the head would advance to the
-	// current location of the tail), we're about to overflow the buffer
-	// and so we don't write the character or advance the head.
-	if (i != tail[port]) {
+	// current location of the tail), we're about to overflow the buffer:
+	// the partial line is dropped and the remainder will be skipped.
+	if (i == tail[port]) {
+		len = (size[port]+head[port]-lineBegin[port])%size[port];
+		stats[port].dropped += len+1;
+		bytes[port] -= len;
+		head[port] = lineBegin[port];
+		lineDrop[port] = !eol;
+		scheduleTopHalve(port);
+		return;
+	}
+
 // sbi(PORTA, PA2);
-		buffer[port][head[port]] = c;
-		head[port] = i;
-		bytes[port]++;
-		// Look if we are at end-of-line to schedule the top-halve handler
-		if ( c == LINE_TERMINATOR ) {
+	buffer[port][head[port]] = c;
+	head[port] = i;
+	bytes[port]++;
+	if ( bytes[port] > stats[port].peak )
+		stats[port].peak = bytes[port];
+	// Schedule the top-halve handler only when we have a complete line
+	if ( eol ) {
 // sbi(PORTA, PA3);
+		if (lines[port] < UART_LINES) {
+			slot = (lineFirst[port]+lines[port])%UART_LINES;
+			lineStart[port][slot] = lineBegin[port];
+			lineLen[port][slot] = (size[port]+i-lineBegin[port])%size[port];
 			lines[port]++;
-			// Scheduling top-halves only when we have a complete line
-			// in the buffer
-			scheduleTopHalve(port);
-		}
-		// Safety schedule the top-halve if the buffer is filled for more than limit value
-		if ( bytes[port] > limit[port] ) {
-			scheduleTopHalve(port);
+			lineBegin[port] = i;
+			stats[port].lines++;
+		} else {
+			// No more descriptors: dropping the line
+			len = (size[port]+i-lineBegin[port])%size[port];
+			stats[port].dropped += len;
+			bytes[port] -= len;
+			head[port] = lineBegin[port];
 		}
-	} else {
+		scheduleTopHalve(port);
+	}
+	// Safety schedule the top-halve if the buffer is filled for more than limit value
+	if ( bytes[port] > limit[port] ) {
 		scheduleTopHalve(port);
 	}
 }
 
 SIGNAL (SIG_UART0_RECV) { // UART0 RX interrupt
-// sbi(PORTA, PA1);
+	// NOTE the status must be read before the data register
+	uint8_t status = UCSR0A;
+	PROFILE_BEGIN(PROF_ISR_UART0_RX);
+	
+	if ( status & _BV(FE0) )
+		stats[UART0].frameErr++;
+	if ( status & _BV(DOR0) )
+		stats[UART0].overrun++;
 	rxByte(UART0, UDR0);
+	
+	PROFILE_END(PROF_ISR_UART0_RX);
 }
 
 SIGNAL (SIG_UART1_RECV) { // UART1 RX interrupt
+	// NOTE the status must be read before the data register
+	uint8_t status = UCSR1A;
+	PROFILE_BEGIN(PROF_ISR_UART1_RX);
+	
+	if ( status & _BV(FE1) )
+		stats[UART1].frameErr++;
+	if ( status & _BV(DOR1) )
+		stats[UART1].overrun++;
 	rxByte(UART1, UDR1);
+	
+	PROFILE_END(PROF_ISR_UART1_RX);
+}
+
+SIGNAL (SIG_UART0_DATA) { // UART0 data register empty interrupt
+	PROFILE_BEGIN(PROF_ISR_UART0_TX);
+	
+	// Nothing more to send: disable this interrupt until next print()
+	if ( !txByte(UART0) )
+		cbi(UCSR0B, UDRIE0);
+	
+	PROFILE_END(PROF_ISR_UART0_TX);
+}
+
+SIGNAL (SIG_UART1_DATA) { // UART1 data register empty interrupt
+	PROFILE_BEGIN(PROF_ISR_UART1_TX);
+	
+	// Nothing more to send: disable this interrupt until next print()
+	if ( !txByte(UART1) )
+		cbi(UCSR1B, UDRIE1);
+	
+	PROFILE_END(PROF_ISR_UART1_TX);
 }
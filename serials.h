@@ -20,13 +20,23 @@
 #ifndef HardwareSerial_h
 #define HardwareSerial_h
 
+#include <avr/pgmspace.h>
+
 #include "at90can.h"
 
+// Default baud rates, used when none has been saved into EEPROM
 #define UART0_BAUD_RATE 9600
 #define UART1_BAUD_RATE 9600
 
-// Compute the UART baud rate
-#define UART_BAUD_CALC(UART_BAUD_RATE,F_CPU) (((F_CPU)/((UART_BAUD_RATE)*16l))-1)
+// Compute the UART baud rate divisor (rounded) for the specified sampling
+// rate: 16 for single speed, 8 for double speed (U2X) operations
+#define UART_BAUD_CALC(UART_BAUD_RATE,F_CPU,DIV)			\
+	((((F_CPU)+(DIV)*(UART_BAUD_RATE)/2)/((DIV)*(UART_BAUD_RATE)))-1)
+
+// Max acceptable baud rate error [per mille]
+// NOTE @8MHz 57600 is generated with U2X at 2.1%, while 115200 can't be
+//	generated within this limit
+#define UART_BAUD_MAXERR	25
 
 // Used to define variables for buffering incoming serial data.  We're
 // using a ring buffer (I think), in which rx_buffer_head is the index of the
@@ -43,16 +53,34 @@
 #define UART1_BUFFER_SIZE	32
 #define UART1_BUFFER_THLIMIT	24
 #endif
-#define UART0_BUFFER_SIZE	76
-#define UART0_BUFFER_THLIMIT	72
-#define UART1_BUFFER_SIZE	76
-#define UART1_BUFFER_THLIMIT	72
-
+#define UART0_BUFFER_SIZE	128
+#define UART0_BUFFER_THLIMIT	120
+#define UART1_BUFFER_SIZE	128
+#define UART1_BUFFER_THLIMIT	120
+
+// Transmit queues, drained by the USART Data Register Empty interrupt.
+// The AT port must hold at least a full display() line plus an AT reply,
+// the GPS port only needs to fit the longest UBX command.
+// NOTE max=256
+#define UART0_TXBUFFER_SIZE	128
+#define UART1_TXBUFFER_SIZE	16
 
 
 // Define the line terminator (CR(\r) = 13 = 0x0D)
 #define LINE_TERMINATOR 0x0D
 
+// Number of complete lines descriptors queued for each port
+#define UART_LINES	8
+
+// Binary frames support: a line starting with UART_FRAME_SYNC is a frame
+// "SYNC LEN DATA[LEN] CRC16" delimited by its length instead of by the
+// LINE_TERMINATOR. A frame must fit the buffer, thus LEN is limited to
+// UART_FRAME_MAXLEN. A LF following a LINE_TERMINATOR is discarded.
+#define UART0_FRAMES		1
+#define UART1_FRAMES		0
+#define UART_FRAME_SYNC		'$'
+#define UART_FRAME_MAXLEN	64
+
 typedef enum {
 	UART0 = 0,
 	UART1,
@@ -60,6 +88,30 @@ typedef enum {
 } uart_port_t;
 
 
+/// A view on a complete line still sitting into a UART ring buffer.
+/// The line could wrap at the buffer end, thus chars must be accessed
+/// using lineChar().
+typedef struct {
+	const unsigned char *buff;	///< The port ring buffer
+	uint8_t size;			///< The ring buffer size
+	uint8_t start;			///< Index of the first line char
+	uint8_t len;			///< Line length, LINE_TERMINATOR included
+} uart_line_t;
+
+/// Get the I-th char of the line L
+#define lineChar(L, I)						\
+	((L)->buff[ ((L)->start+(I)) < (L)->size ?		\
+		((L)->start+(I)) : ((L)->start+(I)-(L)->size) ])
+
+/// Per-port receiver statistics
+typedef struct {
+	uint16_t dropped;	///< Bytes dropped on buffer or descriptors overflow
+	uint16_t frameErr;	///< Bytes received with a framing error (FE)
+	uint16_t overrun;	///< Data overruns (DOR), i.e. bytes lost by the USART
+	uint16_t lines;		///< Complete lines received
+	uint8_t  peak;		///< Buffer occupancy high-water mark [bytes]
+} uart_stats_t;
+
 // Top-Halves serials interrupt scheduling flags
 extern uint8_t uart_intr[UART_NUM];
 #define scheduleTopHalve(PORT)	uart_intr[PORT]=1
@@ -74,11 +126,51 @@ char	look(uart_port_t port);
 char	read(uart_port_t port);
 int	readLine(uart_port_t port, char *buff, unsigned short len);
 
+/// @return the number of complete lines queued
+uint8_t	availableLines(uart_port_t port);
+/// Get a view of the oldest complete line, without removing it
+/// @return 0 if there are not complete lines queued
+uint8_t	lookLine(uart_port_t port, uart_line_t *line);
+/// Remove the oldest complete line from the buffer
+void	releaseLine(uart_port_t port);
+
 void	flush(uart_port_t port);
 
-void	print(uart_port_t port, char c);
-void	printStr(uart_port_t port, const char *str);
-void	printLine(uart_port_t port, const char *str);
+/// Select the UBRR/U2X setting with the lowest error for a baud rate.
+/// @return the baud rate error [per mille], -1 if it can't be generated
+int	baudSetting(unsigned long baud, uint16_t *ubrr, uint8_t *u2x);
+/// Change the port baud rate once all queued output has been sent.
+/// Partially received input is discarded.
+/// @return 0 on success, -1 if the baud rate can't be generated
+int	setBaudRate(uart_port_t port, unsigned long baud);
+/// @return the current port baud rate
+unsigned long baudRate(uart_port_t port);
+/// Save the current port baud rate to be restored at next boot
+/// NOTE the GPS receiver port rate must match the receiver configuration
+void	saveBaudRate(uart_port_t port);
+
+/// Get a consistent copy of the port receiver statistics
+void	readStats(uart_port_t port, uart_stats_t *stats);
+/// Reset the port receiver statistics
+void	resetStats(uart_port_t port);
+
+/// Queue a char for transmission.
+/// @return 0 if the char has been queued right away, 1 if the TX queue was
+///	full and the caller has been blocked until a slot has been released
+int	print(uart_port_t port, char c);
+/// @return 0 if the whole string has been queued without blocking
+int	printStr(uart_port_t port, const char *str);
+/// @return 0 if the whole line has been queued without blocking
+int	printLine(uart_port_t port, const char *str);
+/// printStr() of a string stored into flash, e.g. PSTR("...")
+int	printStr_P(uart_port_t port, PGM_P str);
+/// printLine() of a string stored into flash, e.g. PSTR("...")
+int	printLine_P(uart_port_t port, PGM_P str);
+
+/// @return the number of chars which could be queued without blocking
+uint8_t	txFree(uart_port_t port);
+/// Wait for all queued chars to be moved into the transmitter
+void	txDrain(uart_port_t port);
 
 #endif
 
@@ -22,38 +22,63 @@
 
 #include "at90can.h"
 
-// The number of times timer 0 has overflowed since the program started.
-// Must be volatile or gcc will optimize away some uses of it.
+// The milliseconds since the program started, i.e. the number of timer 1
+// compare matches. Must be volatile or gcc will optimize away some uses of it.
 volatile unsigned long timer1_overflow_count = 0;
 
 // The timestamp of last and previous pulses on ICP
 // Must be volatile or gcc will optimize away some uses of it.
 volatile unsigned int timer1_prev_ts = 0;
 
+/// Read at once the timer 1 compare match count and TCNT1, folding in a
+/// pending compare match not yet accounted by SIG_OUTPUT_COMPARE1A
+static void timeSnapshot(unsigned long *base, uint16_t *tcnt) {
+	uint8_t sreg;
+	
+	sreg = SREG;
+	cli();
+	*tcnt = TCNT1;
+	*base = timer1_overflow_count;
+	// TCNT1 has been cleared by the match if a small value has been read
+	if ( (TIFR1 & _BV(OCF1A)) && *tcnt < TIME_TICKS_PER_MS/2 )
+		(*base)++;
+	SREG = sreg;
+}
+
 unsigned long millis(void) {
-	unsigned long base = 0;
-	unsigned long delta = 0;
-	unsigned long t = 0;
-#if 0
-	// timer 0 increments every 64 cycles, and overflows when it reaches
-	// 256.  we would calculate the total number of clock cycles, then
-	// divide by the number of clock cycles per millisecond, but this
-	// overflows too often.
-	//return timer0_overflow_count * 64UL * 256UL / (F_CPU / 1000UL);
-	
-	// instead find 1/128th the number of clock cycles and divide by
-	// 1/128th the number of clock cycles per millisecond
-	return timer0_overflow_count * 64UL * 2UL / (F_CPU / 128000UL);
-#endif
-	//(COUNT * 256UL) / (F_CPU / 1000UL )
-	// This will overflow everty 2.097152 s
-	base = timer1_overflow_count;
-	delta = TCNT1;
+	unsigned long ms;
+	uint8_t sreg;
+	
+	// NOTE the count is updated by SIG_OUTPUT_COMPARE1A every ms: just
+	// its 4 bytes should be read at once
+	sreg = SREG;
+	cli();
+	ms = timer1_overflow_count;
+	SREG = sreg;
+	
+	return ms;
 	
-	t = (delta * 16UL) / (F_CPU / 64000UL);
-	t = t + (base * 8192UL);
-	return t;
+}
+
+unsigned long micros(void) {
+	unsigned long base;
+	uint16_t tcnt;
+	
+	timeSnapshot(&base, &tcnt);
+#if TIME_TICKS_PER_MS == 1000
+	// A tick per us: no scaling
+	return base*1000UL + tcnt;
+#else
+	return base*1000UL + ((unsigned long)tcnt*1000UL)/TIME_TICKS_PER_MS;
+#endif
+}
+
+unsigned long timeTicks(void) {
+	unsigned long base;
+	uint16_t tcnt;
 	
+	timeSnapshot(&base, &tcnt);
+	return base*TIME_TICKS_PER_MS + tcnt;
 }
 
 void delay(unsigned long ms) {
@@ -75,17 +100,16 @@ void initTime(void) {
 	//  Input Capture Edge Select (RAISING EDGE)
 	sbi(TCCR1B, ICES1);
 	
-	// Clock Select (PRESCALER @ 1024)
-	//  F_CPU: 8MHz		===>	F_PSC: 7,8125 KHz
-	//  T_CPU: 0,125us	===>	T_PSC: 128us
-	sbi(TCCR1B, CS12);
-	cbi(TCCR1B, CS11);
-	sbi(TCCR1B, CS10);
+	// Clock Select (PRESCALER @ 8)
+	//  F_CPU: 8MHz		===>	F_PSC: 1 MHz
+	//  T_CPU: 0,125us	===>	T_PSC: 1us
+	cbi(TCCR1B, CS12);
+	sbi(TCCR1B, CS11);
+	cbi(TCCR1B, CS10);
 	
 	// Configure Output Compare Register A (TOP Value)
-	// 64000*T_PSC = 0xFA00*T_PSC ===> 8192ms = 0x2000
-	OCR1AH = 0xFA;
-	OCR1AL = 0x00;
+	// TIME_TICKS_PER_MS*T_PSC = 1ms
+	OCR1A = TIME_TICKS_PER_MS-1;
 	
 	// Configuring "Compare Output Mode for Channel A" to Normal (disconnected PIN)
 	cbi(TCCR1A, COM1A1);